@@ -16,18 +16,35 @@
 #include <string>
 #include <array>
 #include <stdexcept>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <exception>
+#include <sstream>
+#include <tuple>
 
-void KEngineVulkan::ShaderFactory::Init(VulkanCore * vulkanCore)
+void KEngineVulkan::ShaderFactory::Init(VulkanCore * vulkanCore, const std::string& pipelineCacheFilename, const std::string& warmupFilename)
 {
     mCore = vulkanCore;
     mShaderModules.clear();
     mGraphicsPipelines.clear();
+    mPipelineStates.clear();
+    mPipelineCacheFilename = pipelineCacheFilename;
+    mPipelineCacheStats = {};
+    mPipelineDedupStats = {};
+    mLazyLayouts.clear();
+    mLazyPipelines.clear();
+    mLazyPipelineIndices.clear();
+    mPendingLazyPipelines = 0;
+    mWarmupFilename = warmupFilename;
+    LoadPipelineCache();
 }
 
 void KEngineVulkan::ShaderFactory::CreatePipeline(KEngineCore::StringHash name, const std::string& vertexShaderFilename, const std::string& fragmentShaderFilename, const DataLayout& dataLayout, bool transparent)
 {
-    VkPipeline pipeline;
-
     KEngineCore::StringHash vertexHash(vertexShaderFilename.c_str());
     KEngineCore::StringHash fragmentHash(fragmentShaderFilename.c_str());
 
@@ -39,16 +56,397 @@ void KEngineVulkan::ShaderFactory::CreatePipeline(KEngineCore::StringHash name,
         mShaderModules[fragmentHash] = CompileShader(fragmentShaderFilename);
     }
 
+    std::string state = PipelineState(vertexShaderFilename, fragmentShaderFilename, dataLayout, transparent);
+    mPipelineDedupStats.requests++;
+    auto known = mPipelineStates.find(state);
+    if (known != mPipelineStates.end()) {
+        mPipelineDedupStats.duplicatesAvoided++;
+        mGraphicsPipelines[name] = known->second;
+        return;
+    }
+
+    PipelineBuild build = BuildPipeline(mShaderModules[vertexHash], mShaderModules[fragmentHash], dataLayout, transparent);
+    RecordPipelineBuild(build);
+    mPipelineStates[state] = build.pipeline;
+    mGraphicsPipelines[name] = build.pipeline;
+}
+
+KEngineVulkan::ShaderFactory::PipelineBatchTiming KEngineVulkan::ShaderFactory::CreatePipelines(const std::vector<PipelineDescription>& pipelines)
+{
+    auto batchStart = std::chrono::steady_clock::now();
+    PipelineBatchTiming timing{};
+    timing.pipelineCount = static_cast<uint32_t>(pipelines.size());
+
+    //Shader modules first, each file once, then every pipeline can find both of its modules without locking
+    std::vector<std::pair<KEngineCore::StringHash, std::string>> shaders;
+    for (const PipelineDescription& description : pipelines) {
+        for (const std::string* filename : { &description.vertexShaderFilename, &description.fragmentShaderFilename }) {
+            KEngineCore::StringHash hash(filename->c_str());
+            if (mShaderModules.find(hash) == mShaderModules.end() &&
+                std::find_if(shaders.begin(), shaders.end(), [hash](const auto& shader) { return shader.first == hash; }) == shaders.end()) {
+                shaders.emplace_back(hash, *filename);
+            }
+        }
+    }
+    std::vector<VkShaderModule> modules(shaders.size(), VK_NULL_HANDLE);
+    std::vector<double> moduleSeconds(shaders.size(), 0.0);
+    std::exception_ptr error = mCore->getWorkerPool().ParallelFor(shaders.size(), [&](size_t i) {
+        auto start = std::chrono::steady_clock::now();
+        modules[i] = CompileShader(shaders[i].second);
+        moduleSeconds[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    });
+    for (size_t i = 0; i < shaders.size(); i++) {
+        if (modules[i] != VK_NULL_HANDLE) {
+            mShaderModules[shaders[i].first] = modules[i];
+        }
+        timing.compileSeconds += moduleSeconds[i];
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    //Only the first description of each state not already known gets built, the rest alias it
+    std::vector<std::string> states(pipelines.size());
+    std::vector<size_t> unique;
+    std::map<std::string, size_t> batchStates;
+    for (size_t i = 0; i < pipelines.size(); i++) {
+        const PipelineDescription& description = pipelines[i];
+        states[i] = PipelineState(description.vertexShaderFilename, description.fragmentShaderFilename, *description.dataLayout, description.transparent);
+        if (mPipelineStates.find(states[i]) == mPipelineStates.end() && batchStates.emplace(states[i], i).second) {
+            unique.push_back(i);
+        }
+    }
+
+    //vkCreateGraphicsPipelines is free threaded and the cache synchronizes itself, results are published here on the calling thread
+    std::vector<PipelineBuild> builds(unique.size(), PipelineBuild{ VK_NULL_HANDLE, 0.0, false });
+    error = mCore->getWorkerPool().ParallelFor(unique.size(), [&](size_t i) {
+        const PipelineDescription& description = pipelines[unique[i]];
+        VkShaderModule vertexShader = mShaderModules.find(KEngineCore::StringHash(description.vertexShaderFilename.c_str()))->second;
+        VkShaderModule fragmentShader = mShaderModules.find(KEngineCore::StringHash(description.fragmentShaderFilename.c_str()))->second;
+        builds[i] = BuildPipeline(vertexShader, fragmentShader, *description.dataLayout, description.transparent);
+    });
+    for (size_t i = 0; i < unique.size(); i++) {
+        if (builds[i].pipeline == VK_NULL_HANDLE) {
+            continue;
+        }
+        mPipelineStates[states[unique[i]]] = builds[i].pipeline;
+        RecordPipelineBuild(builds[i]);
+        timing.builtCount++;
+        timing.compileSeconds += builds[i].seconds;
+    }
+    for (size_t i = 0; i < pipelines.size(); i++) {
+        auto known = mPipelineStates.find(states[i]);
+        if (known == mPipelineStates.end()) {
+            continue;
+        }
+        mPipelineDedupStats.requests++;
+        auto first = batchStates.find(states[i]);
+        if (first == batchStates.end() || first->second != i) {
+            mPipelineDedupStats.duplicatesAvoided++;
+        }
+        mGraphicsPipelines[pipelines[i].name] = known->second;
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    timing.threadCount = mCore->getWorkerPool().GetThreadCount() + 1;
+    timing.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - batchStart).count();
+    return timing;
+}
+
+bool KEngineVulkan::ShaderFactory::PipelineKey::operator<(const PipelineKey& other) const
+{
+    return std::tie(vertexShaderFilename, fragmentShaderFilename, layoutName, transparent) < std::tie(other.vertexShaderFilename, other.fragmentShaderFilename, other.layoutName, other.transparent);
+}
+
+void KEngineVulkan::ShaderFactory::RegisterDataLayout(const std::string& layoutName, const DataLayout& dataLayout, KEngineCore::StringHash fallbackPipeline)
+{
+    mLazyLayouts[layoutName] = { &dataLayout, GetGraphicsPipeline(fallbackPipeline) };
+}
+
+KEngineVulkan::PipelineHandle KEngineVulkan::ShaderFactory::RequestPipeline(const PipelineKey& key)
+{
+    auto known = mLazyPipelineIndices.find(key);
+    if (known != mLazyPipelineIndices.end()) {
+        return { known->second };
+    }
+    auto layout = mLazyLayouts.find(key.layoutName);
+    if (layout == mLazyLayouts.end()) {
+        throw std::runtime_error("failed to find data layout " + key.layoutName + "!");
+    }
+    uint32_t index = static_cast<uint32_t>(mLazyPipelines.size());
+    LazyPipeline lazy;
+    lazy.key = key;
+    lazy.layout = &layout->second;
+    mLazyPipelines.push_back(lazy);
+    mLazyPipelineIndices[key] = index;
+    return { index };
+}
+
+VkPipeline KEngineVulkan::ShaderFactory::GetPipeline(PipelineHandle handle) const
+{
+    assert(handle.IsValid() && handle.index < mLazyPipelines.size());
+    const LazyPipeline& lazy = mLazyPipelines[handle.index];
+    lazy.used = true;
+    return lazy.pipeline != VK_NULL_HANDLE ? lazy.pipeline : lazy.layout->fallback;
+}
+
+bool KEngineVulkan::ShaderFactory::IsPipelineReady(PipelineHandle handle) const
+{
+    assert(handle.IsValid() && handle.index < mLazyPipelines.size());
+    return mLazyPipelines[handle.index].pipeline != VK_NULL_HANDLE;
+}
+
+void KEngineVulkan::ShaderFactory::UpdatePipelines()
+{
+    assert(!mCore->inRenderPass()); // Handles only change between frames
+    PublishLazyPipelines();
+    QueueLazyPipelines();
+}
+
+uint32_t KEngineVulkan::ShaderFactory::WarmUpPipelines()
+{
+    std::vector<PipelineKey> keys;
+    LoadWarmupList(keys);
+    uint32_t queued = mPendingLazyPipelines;
+    for (const PipelineKey& key : keys) {
+        //Layouts can be renamed or dropped between runs, their old permutations are just skipped
+        if (mLazyLayouts.find(key.layoutName) != mLazyLayouts.end()) {
+            mLazyPipelines[RequestPipeline(key).index].warm = true;
+        }
+    }
+    QueueLazyPipelines();
+    return mPendingLazyPipelines - queued;
+}
+
+uint32_t KEngineVulkan::ShaderFactory::GetPendingPipelineCount() const
+{
+    return mPendingLazyPipelines;
+}
+
+void KEngineVulkan::ShaderFactory::QueueLazyPipelines()
+{
+    for (uint32_t index = 0; index < mLazyPipelines.size(); index++) {
+        LazyPipeline& lazy = mLazyPipelines[index];
+        if (lazy.queued || !(lazy.used || lazy.warm)) {
+            continue;
+        }
+        lazy.queued = true;
+
+        //Modules are cheap next to the pipeline, making them here keeps mShaderModules on this thread
+        VkShaderModule modules[2];
+        const std::string* filenames[2] = { &lazy.key.vertexShaderFilename, &lazy.key.fragmentShaderFilename };
+        for (int stage = 0; stage < 2; stage++) {
+            KEngineCore::StringHash hash(filenames[stage]->c_str());
+            if (mShaderModules.find(hash) == mShaderModules.end()) {
+                mShaderModules[hash] = CompileShader(*filenames[stage]);
+            }
+            modules[stage] = mShaderModules[hash];
+        }
+
+        const DataLayout* dataLayout = lazy.layout->dataLayout;
+        bool transparent = lazy.key.transparent;
+        std::string state = PipelineState(lazy.key.vertexShaderFilename, lazy.key.fragmentShaderFilename, *dataLayout, transparent);
+        auto known = mPipelineStates.find(state);
+        if (known != mPipelineStates.end()) {
+            mPipelineDedupStats.requests++;
+            mPipelineDedupStats.duplicatesAvoided++;
+            lazy.pipeline = known->second;
+            continue;
+        }
+
+        mPendingLazyPipelines++;
+        QueueCompile([this, index, modules, dataLayout, transparent, state] {
+            LazyBuild lazyBuild{ index, state, PipelineBuild{ VK_NULL_HANDLE, 0.0, false } };
+            try {
+                lazyBuild.build = BuildPipeline(modules[0], modules[1], *dataLayout, transparent);
+            }
+            catch (const std::exception& exception) {
+                std::cerr << "failed to compile lazy pipeline: " << exception.what() << std::endl;
+            }
+            catch (...) {
+                std::cerr << "failed to compile lazy pipeline" << std::endl;
+            }
+            std::lock_guard<std::mutex> lock(mLazyBuildMutex);
+            mLazyBuilds.push_back(std::move(lazyBuild));
+        });
+    }
+}
+
+void KEngineVulkan::ShaderFactory::PublishLazyPipelines()
+{
+    std::vector<LazyBuild> builds;
+    {
+        std::lock_guard<std::mutex> lock(mLazyBuildMutex);
+        builds.swap(mLazyBuilds);
+    }
+    for (LazyBuild& lazyBuild : builds) {
+        LazyPipeline& lazy = mLazyPipelines[lazyBuild.index];
+        mPendingLazyPipelines--;
+        if (lazyBuild.build.pipeline == VK_NULL_HANDLE) {
+            continue;
+        }
+        RecordPipelineBuild(lazyBuild.build);
+        mPipelineDedupStats.requests++;
+        //Two keys can reach the same state while both are in flight, the later one is thrown away
+        auto known = mPipelineStates.find(lazyBuild.state);
+        if (known != mPipelineStates.end()) {
+            vkDestroyPipeline(mCore->getDevice(), lazyBuild.build.pipeline, nullptr);
+            mPipelineDedupStats.duplicatesAvoided++;
+            lazy.pipeline = known->second;
+        }
+        else {
+            mPipelineStates[lazyBuild.state] = lazyBuild.build.pipeline;
+            lazy.pipeline = lazyBuild.build.pipeline;
+        }
+    }
+}
+
+void KEngineVulkan::ShaderFactory::LoadWarmupList(std::vector<PipelineKey>& keys) const
+{
+    if (mWarmupFilename.empty()) {
+        return;
+    }
+    //One permutation per line: vertex shader, fragment shader, layout name and 0 or 1 for transparent, tab separated
+    std::ifstream stream(mWarmupFilename);
+    std::string line;
+    while (std::getline(stream, line)) {
+        std::istringstream fields(line);
+        PipelineKey key;
+        std::string transparent;
+        if (std::getline(fields, key.vertexShaderFilename, '\t') && std::getline(fields, key.fragmentShaderFilename, '\t') &&
+            std::getline(fields, key.layoutName, '\t') && std::getline(fields, transparent)) {
+            key.transparent = transparent == "1";
+            keys.push_back(key);
+        }
+    }
+}
+
+void KEngineVulkan::ShaderFactory::SaveWarmupList() const
+{
+    if (mWarmupFilename.empty()) {
+        return;
+    }
+    //Only what was drawn this session, so permutations that stop being used drop out of the next warm-up
+    bool anyUsed = std::any_of(mLazyPipelines.begin(), mLazyPipelines.end(), [](const LazyPipeline& lazy) { return lazy.used; });
+    if (!anyUsed) {
+        return;
+    }
+    std::ofstream stream(mWarmupFilename, std::ios::trunc);
+    for (const LazyPipeline& lazy : mLazyPipelines) {
+        if (lazy.used) {
+            stream << lazy.key.vertexShaderFilename << '\t' << lazy.key.fragmentShaderFilename << '\t' << lazy.key.layoutName << '\t' << (lazy.key.transparent ? 1 : 0) << '\n';
+        }
+    }
+}
+
+void KEngineVulkan::ShaderFactory::QueueCompile(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mCompileMutex);
+        mPendingCompiles++;
+    }
+    auto finished = [this] {
+        std::lock_guard<std::mutex> lock(mCompileMutex);
+        if (--mPendingCompiles == 0) {
+            mCompileCondition.notify_all();
+        }
+    };
+    try {
+        mCore->getWorkerPool().Queue([job = std::move(job), finished] {
+            //Counted off even if the job throws, or WaitForCompiles would wait forever
+            try {
+                job();
+            }
+            catch (...) {
+                finished();
+                throw;
+            }
+            finished();
+        });
+    }
+    catch (...) {
+        finished();
+        throw;
+    }
+}
+
+void KEngineVulkan::ShaderFactory::WaitForCompiles()
+{
+    std::unique_lock<std::mutex> lock(mCompileMutex);
+    mCompileCondition.wait(lock, [this] { return mPendingCompiles == 0; });
+}
+
+std::string KEngineVulkan::ShaderFactory::PipelineState(const std::string& vertexShaderFilename, const std::string& fragmentShaderFilename, const DataLayout& dataLayout, bool transparent) const
+{
+    //Everything BuildPipeline reads, as raw bytes. The vertex input structs are all 32 bit fields, so there's no padding to worry about.
+    //The render pass and the view set layout are the core's, one each for its lifetime, so they are left out
+    std::string state;
+    auto append = [&state](const void* data, size_t size) { state.append(static_cast<const char*>(data), size); };
+    auto appendString = [&append](const std::string& text) {
+        uint32_t length = static_cast<uint32_t>(text.size());
+        append(&length, sizeof(length));
+        append(text.data(), length);
+    };
+    appendString(vertexShaderFilename);
+    appendString(fragmentShaderFilename);
+    append(&transparent, sizeof(transparent));
+
+    const auto& bindingDescriptions = dataLayout.getAttributeBindingDescriptions();
+    const auto& attributeDescriptions = dataLayout.getAttributeDescriptions();
+    uint32_t bindingCount = static_cast<uint32_t>(bindingDescriptions.size());
+    uint32_t attributeCount = static_cast<uint32_t>(attributeDescriptions.size());
+    append(&bindingCount, sizeof(bindingCount));
+    append(bindingDescriptions.data(), bindingCount * sizeof(VkVertexInputBindingDescription));
+    append(&attributeCount, sizeof(attributeCount));
+    append(attributeDescriptions.data(), attributeCount * sizeof(VkVertexInputAttributeDescription));
+
+    //The pipeline layout, field by field since the set layout bindings carry a sampler pointer
+    bool viewSet = dataLayout.usesViewSet();
+    append(&viewSet, sizeof(viewSet));
+    const auto& setBindings = dataLayout.getDescriptorSetLayoutBindings();
+    uint32_t setBindingCount = static_cast<uint32_t>(setBindings.size());
+    append(&setBindingCount, sizeof(setBindingCount));
+    for (const VkDescriptorSetLayoutBinding& setBinding : setBindings) {
+        append(&setBinding.binding, sizeof(setBinding.binding));
+        append(&setBinding.descriptorType, sizeof(setBinding.descriptorType));
+        append(&setBinding.descriptorCount, sizeof(setBinding.descriptorCount));
+        append(&setBinding.stageFlags, sizeof(setBinding.stageFlags));
+    }
+    const auto& pushConstantRanges = dataLayout.getPushConstantRanges();
+    uint32_t pushConstantCount = static_cast<uint32_t>(pushConstantRanges.size());
+    append(&pushConstantCount, sizeof(pushConstantCount));
+    append(pushConstantRanges.data(), pushConstantCount * sizeof(VkPushConstantRange));
+    return state;
+}
+
+void KEngineVulkan::ShaderFactory::RecordPipelineBuild(const PipelineBuild& build)
+{
+    mPipelineCacheStats.pipelinesCreated++;
+    if (build.cacheHit) {
+        mPipelineCacheStats.cacheHits++;
+        mPipelineCacheStats.hitSeconds += build.seconds;
+    }
+    else {
+        mPipelineCacheStats.missSeconds += build.seconds;
+    }
+}
+
+KEngineVulkan::ShaderFactory::PipelineBuild KEngineVulkan::ShaderFactory::BuildPipeline(VkShaderModule vertexShader, VkShaderModule fragmentShader, const DataLayout& dataLayout, bool transparent) const
+{
+    VkPipeline pipeline;
+
     VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
     vertShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-    vertShaderStageInfo.module = mShaderModules[vertexHash];
+    vertShaderStageInfo.module = vertexShader;
     vertShaderStageInfo.pName = "main";
 
     VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
     fragShaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-    fragShaderStageInfo.module = mShaderModules[fragmentHash];
+    fragShaderStageInfo.module = fragmentShader;
     fragShaderStageInfo.pName = "main";
 
     VkPipelineShaderStageCreateInfo shaderStages[] = { vertShaderStageInfo, fragShaderStageInfo };
@@ -69,39 +467,23 @@ void KEngineVulkan::ShaderFactory::CreatePipeline(KEngineCore::StringHash name,
     inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
     inputAssembly.primitiveRestartEnable = VK_FALSE;
 
-    const bool dynamicViewport = false;
-    if (dynamicViewport) {
-        std::vector<VkDynamicState> dynamicStates = {
-            VK_DYNAMIC_STATE_VIEWPORT,
-            VK_DYNAMIC_STATE_SCISSOR
-        };
-
-        VkPipelineDynamicStateCreateInfo dynamicState{};
-        dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
-        dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
-        dynamicState.pDynamicStates = dynamicStates.data();
-    }
-
-    const VkExtent2D& framebufferExtent = mCore->getFramebufferExtent();
+    //Viewport and scissor come from the command buffer, so a resize doesn't cost a single pipeline
+    VkDynamicState dynamicStates[] = {
+        VK_DYNAMIC_STATE_VIEWPORT,
+        VK_DYNAMIC_STATE_SCISSOR
+    };
 
-    VkViewport viewport{};
-    viewport.x = 0.0f;
-    viewport.y = 0.0f;
-    viewport.width = (float)framebufferExtent.width;
-    viewport.height = (float)framebufferExtent.height;
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
-
-    VkRect2D scissor{};
-    scissor.offset = { 0, 0 };
-    scissor.extent = framebufferExtent;
+    VkPipelineDynamicStateCreateInfo dynamicState{};
+    dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+    dynamicState.dynamicStateCount = 2;
+    dynamicState.pDynamicStates = dynamicStates;
 
     VkPipelineViewportStateCreateInfo viewportState{};
     viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
     viewportState.viewportCount = 1;
-    viewportState.pViewports = &viewport;
+    viewportState.pViewports = nullptr; // Dynamic
     viewportState.scissorCount = 1;
-    viewportState.pScissors = &scissor;
+    viewportState.pScissors = nullptr; // Dynamic
     
 
     VkPipelineRasterizationStateCreateInfo rasterizer{};
@@ -163,7 +545,7 @@ void KEngineVulkan::ShaderFactory::CreatePipeline(KEngineCore::StringHash name,
     pipelineInfo.pMultisampleState = &multisampling;
     pipelineInfo.pDepthStencilState = nullptr; // Optional
     pipelineInfo.pColorBlendState = &colorBlending;
-    pipelineInfo.pDynamicState = nullptr; // Optional
+    pipelineInfo.pDynamicState = &dynamicState;
     pipelineInfo.layout = dataLayout.getPipelineLayout();
     pipelineInfo.renderPass = mCore->getRenderPass();
     pipelineInfo.subpass = 0;
@@ -171,11 +553,25 @@ void KEngineVulkan::ShaderFactory::CreatePipeline(KEngineCore::StringHash name,
     pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional  //Actually don't use this
     pipelineInfo.basePipelineIndex = -1; // Optional
 
-    if (vkCreateGraphicsPipelines(mCore->getDevice(), VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS) {
-        throw std::runtime_error("failed to create graphics pipeline!");
+    //The driver tells us whether the cache saved it the compile, when it can
+    VkPipelineCreationFeedbackEXT creationFeedback{};
+    VkPipelineCreationFeedbackEXT stageFeedback[2]{};
+    VkPipelineCreationFeedbackCreateInfoEXT feedbackInfo{};
+    feedbackInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CREATION_FEEDBACK_CREATE_INFO_EXT;
+    feedbackInfo.pPipelineCreationFeedback = &creationFeedback;
+    feedbackInfo.pipelineStageCreationFeedbackCount = pipelineInfo.stageCount;
+    feedbackInfo.pPipelineStageCreationFeedbacks = stageFeedback;
+    if (mCore->hasPipelineCreationFeedback()) {
+        pipelineInfo.pNext = &feedbackInfo;
     }
 
-    mGraphicsPipelines[name] = pipeline;
+    auto start = std::chrono::steady_clock::now();
+    if (vkCreateGraphicsPipelines(mCore->getDevice(), mPipelineCache, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create graphics pipeline!");
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    bool cacheHit = (creationFeedback.flags & VK_PIPELINE_CREATION_FEEDBACK_VALID_BIT_EXT) && (creationFeedback.flags & VK_PIPELINE_CREATION_FEEDBACK_APPLICATION_PIPELINE_CACHE_HIT_BIT_EXT);
+    return { pipeline, seconds, cacheHit };
 }
 
 VkPipeline KEngineVulkan::ShaderFactory::GetGraphicsPipeline(KEngineCore::StringHash name)
@@ -186,22 +582,120 @@ VkPipeline KEngineVulkan::ShaderFactory::GetGraphicsPipeline(KEngineCore::String
 
 void KEngineVulkan::ShaderFactory::ClearModules()
 {
+    WaitForCompiles(); // Queued lazy compiles hold module handles
     for (auto & modulePair : mShaderModules)
     {
         auto module = modulePair.second;
         vkDestroyShaderModule(mCore->getDevice(), module, nullptr);
     }
+    mShaderModules.clear();
 }
 
 void KEngineVulkan::ShaderFactory::Deinit()
 {
+    WaitForCompiles(); // Finishes queued lazy pipelines, so publishing hands them to mPipelineStates to be destroyed
+    PublishLazyPipelines();
+    SaveWarmupList();
+    mLazyPipelines.clear();
+    mLazyPipelineIndices.clear();
+    mLazyLayouts.clear();
     ClearModules();
-    for (auto pipelinePair : mGraphicsPipelines)
+    //Names can alias one pipeline, the state map holds each exactly once
+    for (auto statePair : mPipelineStates)
     {
-        auto& pipeline = pipelinePair.second;
+        auto& pipeline = statePair.second;
         vkDestroyPipeline(mCore->getDevice(), pipeline, nullptr);
 
     }
+    mPipelineStates.clear();
+    mGraphicsPipelines.clear();
+
+    if (mPipelineCache != VK_NULL_HANDLE) {
+        SavePipelineCache();
+        vkDestroyPipelineCache(mCore->getDevice(), mPipelineCache, nullptr);
+        mPipelineCache = VK_NULL_HANDLE;
+    }
+}
+
+const KEngineVulkan::ShaderFactory::PipelineCacheStats& KEngineVulkan::ShaderFactory::GetPipelineCacheStats() const
+{
+    return mPipelineCacheStats;
+}
+
+const KEngineVulkan::ShaderFactory::PipelineDedupStats& KEngineVulkan::ShaderFactory::GetPipelineDedupStats() const
+{
+    return mPipelineDedupStats;
+}
+
+void KEngineVulkan::ShaderFactory::LoadPipelineCache()
+{
+    std::vector<char> data;
+    if (!mPipelineCacheFilename.empty()) {
+        std::ifstream stream(mPipelineCacheFilename, std::ios::binary | std::ios::ate);
+        if (stream) {
+            data.resize(static_cast<size_t>(stream.tellg()));
+            stream.seekg(0);
+            stream.read(data.data(), data.size());
+        }
+    }
+    //Drivers are meant to reject foreign blobs themselves, but not all of them do it gracefully
+    if (!IsPipelineCacheCompatible(data)) {
+        data.clear();
+    }
+
+    VkPipelineCacheCreateInfo createInfo{};
+    createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    createInfo.initialDataSize = data.size();
+    createInfo.pInitialData = data.empty() ? nullptr : data.data();
+    if (vkCreatePipelineCache(mCore->getDevice(), &createInfo, nullptr, &mPipelineCache) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create pipeline cache!");
+    }
+    mPipelineCacheStats.loadedBytes = data.size();
+}
+
+void KEngineVulkan::ShaderFactory::SavePipelineCache()
+{
+    if (mPipelineCacheFilename.empty()) {
+        return;
+    }
+    size_t size = 0;
+    if (vkGetPipelineCacheData(mCore->getDevice(), mPipelineCache, &size, nullptr) != VK_SUCCESS || size == 0) {
+        return;
+    }
+    std::vector<char> data(size);
+    if (vkGetPipelineCacheData(mCore->getDevice(), mPipelineCache, &size, data.data()) != VK_SUCCESS) {
+        return;
+    }
+    //Written beside the old cache and renamed over it, so a crash mid-write can't leave a torn file for the next launch.
+    //A failed write only costs the next launch its warm start
+    std::string temporaryFilename = mPipelineCacheFilename + ".tmp";
+    std::ofstream stream(temporaryFilename, std::ios::binary | std::ios::trunc);
+    stream.write(data.data(), size);
+    stream.close();
+    std::error_code error;
+    if (stream) {
+        std::filesystem::rename(temporaryFilename, mPipelineCacheFilename, error);
+    }
+    if (!stream || error) {
+        std::filesystem::remove(temporaryFilename, error);
+    }
+}
+
+bool KEngineVulkan::ShaderFactory::IsPipelineCacheCompatible(const std::vector<char>& data) const
+{
+    //VK_PIPELINE_CACHE_HEADER_VERSION_ONE: header size, header version, vendor ID, device ID, then the 16 byte cache UUID
+    const size_t headerSize = 16 + VK_UUID_SIZE;
+    if (data.size() < headerSize) {
+        return false;
+    }
+    uint32_t header[4];
+    memcpy(header, data.data(), sizeof(header));
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(mCore->getPhysicalDevice(), &properties);
+    return header[0] >= headerSize && header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+        header[2] == properties.vendorID && header[3] == properties.deviceID &&
+        memcmp(data.data() + 16, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
 }
 
 KEngineVulkan::VulkanCore* KEngineVulkan::ShaderFactory::GetCore() const {
@@ -235,20 +729,103 @@ const VkDescriptorSetLayout& KEngineVulkan::DataLayout::getDescriptorSetLayout()
     return mDescriptorSetLayout;
 }
 
+const std::vector<VkDescriptorSetLayoutBinding>& KEngineVulkan::DataLayout::getDescriptorSetLayoutBindings() const
+{
+    assert(mDescriptionsGenerated);
+    return mDescriptorSetLayoutBindings;
+}
+
 VkPipelineLayout KEngineVulkan::DataLayout::getPipelineLayout() const
 {
     return pipelineLayout;
 }
 
+bool KEngineVulkan::DataLayout::usesViewSet() const
+{
+    return mUsesViewSet;
+}
+
+uint32_t KEngineVulkan::DataLayout::getObjectSetIndex() const
+{
+    return mUsesViewSet ? 1 : 0;
+}
+
+bool KEngineVulkan::DataLayout::hasInstanceBinding() const
+{
+    assert(mDescriptionsGenerated);
+    return mInstanceBinding.has_value();
+}
+
+uint32_t KEngineVulkan::DataLayout::getInstanceBinding() const
+{
+    assert(mInstanceBinding.has_value());
+    return mInstanceBinding.value();
+}
+
+bool KEngineVulkan::DataLayout::hasInstanceUvBinding() const
+{
+    assert(mDescriptionsGenerated);
+    return mInstanceUvBinding.has_value();
+}
+
+uint32_t KEngineVulkan::DataLayout::getInstanceUvBinding() const
+{
+    assert(mInstanceUvBinding.has_value());
+    return mInstanceUvBinding.value();
+}
+
+const std::vector<VkPushConstantRange>& KEngineVulkan::DataLayout::getPushConstantRanges() const
+{
+    return mPushConstantRanges;
+}
+
+bool KEngineVulkan::DataLayout::hasModelPushConstant() const
+{
+    return mHasModelPushConstant;
+}
+
+bool KEngineVulkan::DataLayout::hasUvPushConstant() const
+{
+    return mHasUvPushConstant;
+}
+
+VkShaderStageFlags KEngineVulkan::DataLayout::getModelPushConstantStages() const
+{
+    assert(mHasModelPushConstant);
+    return mPushConstantRanges[0].stageFlags;
+}
+
+std::optional<uint32_t> KEngineVulkan::DataLayout::getUniformBufferBinding() const
+{
+    return mUniformBufferBinding;
+}
+
+std::optional<uint32_t> KEngineVulkan::DataLayout::getSamplerBinding() const
+{
+    return mSamplerBinding;
+}
+
+bool KEngineVulkan::DataLayout::hasObjectBindings() const
+{
+    return mHasObjectBindings;
+}
+
 const std::vector<VkVertexInputBindingDescription>& KEngineVulkan::DataLayout::getAttributeBindingDescriptions() const
 {
     assert(mDescriptionsGenerated);
     return mBindingDescriptions;
 }
 
-void KEngineVulkan::DataLayout::Init(KEngineVulkan::VulkanCore * core, const std::vector<AttributeBindingLayout>& attributeBindings, const std::vector<UniformBindingLayout> & uniformBindings)
+void KEngineVulkan::DataLayout::Init(KEngineVulkan::VulkanCore * core, const std::vector<AttributeBindingLayout>& attributeBindings, const std::vector<UniformBindingLayout> & uniformBindings, bool perViewSet, const std::vector<PushConstantLayout> & pushConstants)
 {
+    mUsesViewSet = perViewSet;
+    mUniformBufferBinding.reset();
+    mSamplerBinding.reset();
+    mHasObjectBindings = !uniformBindings.empty();
     mAttributeDescriptions.clear();
+    mBindingDescriptions.clear();
+    mInstanceBinding.reset();
+    mInstanceUvBinding.reset();
     int attributeBindingCount = 0;
     for (auto binding : attributeBindings)
     {
@@ -281,6 +858,18 @@ void KEngineVulkan::DataLayout::Init(KEngineVulkan::VulkanCore * core, const std
                 attributeDescription.format = VK_FORMAT_R32G32B32A32_SFLOAT;
                 offset += 4;
                 break;
+            case DataType::Mat4Float:
+                //Takes four consecutive locations, one per column
+                assert(offset % 4 == 0);
+                attributeDescription.format = VK_FORMAT_R32G32B32A32_SFLOAT;
+                for (int column = 0; column < 3; column++) {
+                    mAttributeDescriptions.push_back(attributeDescription);
+                    attributeDescription.location++;
+                    offset += 4;
+                    attributeDescription.offset = offset * sizeof(float);
+                }
+                offset += 4;
+                break;
             default:
                 assert(false);
             }
@@ -290,12 +879,21 @@ void KEngineVulkan::DataLayout::Init(KEngineVulkan::VulkanCore * core, const std
 
         VkVertexInputBindingDescription bindingDescription;
         bindingDescription.binding = attributeBindingCount++;
-        bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+        bindingDescription.inputRate = binding.perInstance ? VK_VERTEX_INPUT_RATE_INSTANCE : VK_VERTEX_INPUT_RATE_VERTEX;
+        if (binding.perInstance && binding.attributes.size() == 1 && binding.attributes[0].type == DataType::Vec4Float) {
+            assert(!mInstanceUvBinding.has_value()); // Only one UV stream supported
+            mInstanceUvBinding = bindingDescription.binding;
+        }
+        else if (binding.perInstance) {
+            assert(!mInstanceBinding.has_value()); // Only one model stream supported
+            mInstanceBinding = bindingDescription.binding;
+        }
         bindingDescription.stride = offset * sizeof(float);
 
         mBindingDescriptions.push_back(bindingDescription);
 
     }
+    assert(!mInstanceUvBinding.has_value() || mInstanceBinding.has_value()); // UVs only stream alongside model matrices
 
     int uniformBindingCount = 0;
     std::vector<VkDescriptorSetLayoutBinding> uniformBindingDescriptors;
@@ -308,9 +906,15 @@ void KEngineVulkan::DataLayout::Init(KEngineVulkan::VulkanCore * core, const std
         {
             uniformBindingDescriptor.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
             textureSamplers.push_back(core->getSampler(uniformBinding.repeatSampler));
+            if (!mSamplerBinding.has_value()) {
+                mSamplerBinding = uniformBindingDescriptor.binding;
+            }
         }
         else {
-            uniformBindingDescriptor.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+            //Uniform data lives in the core's per-frame arena, each draw picks its slice with a dynamic offset
+            uniformBindingDescriptor.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+            assert(!mUniformBufferBinding.has_value()); // One dynamic offset per object set
+            mUniformBufferBinding = uniformBindingDescriptor.binding;
         }
         uniformBindingDescriptor.pImmutableSamplers = nullptr;
         uniformBindingDescriptor.stageFlags = 
@@ -350,18 +954,79 @@ void KEngineVulkan::DataLayout::Init(KEngineVulkan::VulkanCore * core, const std
     VkDescriptorSetLayoutCreateInfo layoutInfo{};
     layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
     layoutInfo.bindingCount = static_cast<uint32_t>(uniformBindingDescriptors.size());
-    layoutInfo.pBindings = &uniformBindingDescriptors[0];
+    layoutInfo.pBindings = uniformBindingDescriptors.data();
 
     if (vkCreateDescriptorSetLayout(core->getDevice(), &layoutInfo, nullptr, &mDescriptorSetLayout) != VK_SUCCESS) {
         throw std::runtime_error("failed to create descriptor set layout!");
     }
+    mDescriptorSetLayoutBindings = uniformBindingDescriptors;
+
+    std::vector<VkDescriptorSetLayout> setLayouts;
+    if (mUsesViewSet) {
+        setLayouts.push_back(core->getViewDescriptorSetLayout());
+    }
+    setLayouts.push_back(mDescriptorSetLayout);
+
+    mPushConstantRanges.clear();
+    uint32_t pushConstantOffset = 0;
+    VkShaderStageFlags pushConstantStages = 0;
+    for (auto & pushConstant : pushConstants)
+    {
+        VkPushConstantRange range{};
+        range.stageFlags =
+            (pushConstant.isVertex ? VK_SHADER_STAGE_VERTEX_BIT : 0) |
+            (pushConstant.isFragment ? VK_SHADER_STAGE_FRAGMENT_BIT : 0);
+        assert(range.stageFlags != 0);
+        assert((range.stageFlags & pushConstantStages) == 0); // A stage may only appear in one range
+        pushConstantStages |= range.stageFlags;
+        range.offset = pushConstantOffset;
+        uint32_t size = 0;
+        for (auto & field : pushConstant.fields)
+        {
+            switch (field.type)
+            {
+            case DataType::ScalarFloat:
+                size += 4;
+                break;
+            case DataType::Vec2Float:
+                assert(size % 8 == 0);
+                size += 8;
+                break;
+            case DataType::Vec3Float:
+                assert(size % 16 == 0);
+                size += 12;
+                break;
+            case DataType::Vec4Float:
+                assert(size % 16 == 0);
+                size += 16;
+                break;
+            case DataType::Mat4Float:
+                assert(size % 16 == 0);
+                size += 64;
+                break;
+            }
+        }
+        range.size = size;
+        pushConstantOffset += size;
+        mPushConstantRanges.push_back(range);
+    }
+    if (pushConstantOffset > 0) {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(core->getPhysicalDevice(), &properties);
+        if (pushConstantOffset > properties.limits.maxPushConstantsSize) {
+            throw std::runtime_error("push constants exceed maxPushConstantsSize!");
+        }
+    }
+    mHasModelPushConstant = !pushConstants.empty() && pushConstants[0].isVertex &&
+        !pushConstants[0].fields.empty() && pushConstants[0].fields[0].type == DataType::Mat4Float;
+    mHasUvPushConstant = mHasModelPushConstant && pushConstants[0].fields.size() > 1 && pushConstants[0].fields[1].type == DataType::Vec4Float;
 
     VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
     pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipelineLayoutInfo.setLayoutCount = 1;
-    pipelineLayoutInfo.pSetLayouts = &mDescriptorSetLayout;
-    pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
-    pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
+    pipelineLayoutInfo.setLayoutCount = static_cast<uint32_t>(setLayouts.size());
+    pipelineLayoutInfo.pSetLayouts = setLayouts.data();
+    pipelineLayoutInfo.pushConstantRangeCount = static_cast<uint32_t>(mPushConstantRanges.size());
+    pipelineLayoutInfo.pPushConstantRanges = mPushConstantRanges.empty() ? nullptr : mPushConstantRanges.data();
 
     if (vkCreatePipelineLayout(core->getDevice(), &pipelineLayoutInfo, nullptr, &pipelineLayout) != VK_SUCCESS) {
         throw std::runtime_error("failed to create pipeline layout!");
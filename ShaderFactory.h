@@ -12,6 +12,10 @@
 #include <map>
 #include <vector>
 #include <string>
+#include <optional>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
 #include <vulkan/vulkan.h>
 
 namespace KEngineVulkan {
@@ -42,7 +46,10 @@ namespace KEngineVulkan {
                 int location;
             };
             std::vector<AttributeLayout> attributes;
+            bool perInstance{ false };  // Advances once per instance instead of once per vertex
         };
+        //A per-instance binding holding a single Vec4Float is the UV stream, offset in xy and scale in zw.
+        //Any other per-instance binding is the model matrix stream.
 
         struct UniformBindingLayout
         {
@@ -57,13 +64,38 @@ namespace KEngineVulkan {
             };
             std::vector<UniformBufferFieldLayout> bufferFields;
         };
+
+        //Ranges are laid out back to back.  A Mat4Float first field in a vertex range is taken to be the model matrix,
+        //and a Vec4Float right after it the UV offset and scale.
+        //Each range needs at least one stage, no stage may be in two ranges, and all of them must fit in maxPushConstantsSize.
+        struct PushConstantLayout
+        {
+            bool isVertex;
+            bool isFragment;
+            std::vector<UniformBindingLayout::UniformBufferFieldLayout> fields;
+        };
               
 
-        void Init(KEngineVulkan::VulkanCore * core, const std::vector<AttributeBindingLayout>& attributeBindings, const std::vector<UniformBindingLayout> & uniformBindings);        
+        //With perViewSet the core's view set layout becomes set 0 and uniformBindings move to set 1
+        void Init(KEngineVulkan::VulkanCore * core, const std::vector<AttributeBindingLayout>& attributeBindings, const std::vector<UniformBindingLayout> & uniformBindings, bool perViewSet = false, const std::vector<PushConstantLayout> & pushConstants = {});        
         const std::vector<VkVertexInputBindingDescription>& getAttributeBindingDescriptions() const;
         const std::vector<VkVertexInputAttributeDescription>& getAttributeDescriptions() const;
         const VkDescriptorSetLayout& getDescriptorSetLayout() const;
+        const std::vector<VkDescriptorSetLayoutBinding>& getDescriptorSetLayoutBindings() const; // What getDescriptorSetLayout was made from
         VkPipelineLayout getPipelineLayout() const;
+        bool usesViewSet() const;
+        uint32_t getObjectSetIndex() const;
+        bool hasInstanceBinding() const;
+        uint32_t getInstanceBinding() const;
+        bool hasInstanceUvBinding() const;
+        uint32_t getInstanceUvBinding() const;
+        const std::vector<VkPushConstantRange>& getPushConstantRanges() const;
+        bool hasModelPushConstant() const;
+        bool hasUvPushConstant() const;
+        VkShaderStageFlags getModelPushConstantStages() const;
+        std::optional<uint32_t> getUniformBufferBinding() const;  // First uniform buffer in the object set, if any
+        std::optional<uint32_t> getSamplerBinding() const;        // First sampler in the object set, if any
+        bool hasObjectBindings() const;
     private: 
 
 #ifndef NDEBUG
@@ -71,31 +103,173 @@ namespace KEngineVulkan {
 #endif
         std::vector<VkVertexInputBindingDescription> mBindingDescriptions;
         std::vector<VkVertexInputAttributeDescription> mAttributeDescriptions;
+        std::optional<uint32_t> mInstanceBinding;
+        std::optional<uint32_t> mInstanceUvBinding;
         VkDescriptorSetLayout mDescriptorSetLayout;
+        std::vector<VkDescriptorSetLayoutBinding> mDescriptorSetLayoutBindings;
+        bool mUsesViewSet{ false };
+        std::vector<VkPushConstantRange> mPushConstantRanges;
+        bool mHasModelPushConstant{ false };
+        bool mHasUvPushConstant{ false };
+        std::optional<uint32_t> mUniformBufferBinding;
+        std::optional<uint32_t> mSamplerBinding;
+        bool mHasObjectBindings{ false };
 
         VkPipelineLayout pipelineLayout;
         std::vector<VkSampler> textureSamplers;  //Owned by core
     };
 
 
+    struct PipelineHandle
+    {
+        uint32_t index{ UINT32_MAX };
+        bool IsValid() const { return index != UINT32_MAX; }
+    };
+
     class ShaderFactory
     {
     public:
         ~ShaderFactory() { Deinit(); }
-        void Init(VulkanCore * core);
+        //The pipeline cache is read from pipelineCacheFilename at Init and written back at Deinit, an empty name keeps it in memory.
+        //A file from another driver or device is discarded, its header has to match the vendor, device and cache UUID.
+        //The permutations drawn through lazy pipelines are written to warmupFilename at Deinit, an empty name records nothing.
+        void Init(VulkanCore * core, const std::string& pipelineCacheFilename = "pipelines.cache", const std::string& warmupFilename = "pipelines.warmup");
+
+        //Pipelines are shared by state: a name whose shaders, vertex input, blend, layout and render pass match an existing
+        //pipeline gets that pipeline rather than a new one.
         void CreatePipeline(KEngineCore::StringHash name, const std::string& vertexShaderFilename, const std::string& fragmentShaderFilename, const DataLayout& dataLayout, bool transparent);
         VkPipeline GetGraphicsPipeline(KEngineCore::StringHash name);
-        void ClearModules();
+
+        //Batch creation: shader modules and then pipelines are built across the worker threads and published once all have
+        //finished. compileSeconds sums the time every module and pipeline took, wallSeconds is how long the call took.
+        struct PipelineDescription
+        {
+            KEngineCore::StringHash name;
+            std::string vertexShaderFilename;
+            std::string fragmentShaderFilename;
+            const DataLayout* dataLayout;
+            bool transparent;
+        };
+        struct PipelineBatchTiming
+        {
+            uint32_t pipelineCount;
+            uint32_t builtCount;        // Descriptions that needed a new pipeline, the rest matched an existing state
+            uint32_t threadCount;       // Worker threads plus the calling thread
+            double wallSeconds;
+            double compileSeconds;
+        };
+        PipelineBatchTiming CreatePipelines(const std::vector<PipelineDescription>& pipelines);
+
+        //Lazy pipelines: RequestPipeline only names a permutation. The first GetPipeline on its handle marks it used, the next
+        //UpdatePipelines queues its compile on the worker threads, and the handle resolves to its layout's fallback pipeline until
+        //a later UpdatePipelines publishes the result. Call UpdatePipelines once per frame, outside the render pass.
+        struct PipelineKey
+        {
+            std::string vertexShaderFilename;
+            std::string fragmentShaderFilename;
+            std::string layoutName;     // As given to RegisterDataLayout
+            bool transparent;
+            bool operator<(const PipelineKey& other) const;
+        };
+        void RegisterDataLayout(const std::string& layoutName, const DataLayout& dataLayout, KEngineCore::StringHash fallbackPipeline); // Fallback made with CreatePipeline and this layout
+        PipelineHandle RequestPipeline(const PipelineKey& key);
+        VkPipeline GetPipeline(PipelineHandle handle) const;
+        bool IsPipelineReady(PipelineHandle handle) const;
+        void UpdatePipelines();
+
+        //Queues every permutation recorded by the last run whose layout is registered, for the loading screen. Returns how many were
+        //queued; keep calling UpdatePipelines until GetPendingPipelineCount reaches zero.
+        uint32_t WarmUpPipelines();
+        uint32_t GetPendingPipelineCount() const;
+        void ClearModules(); // Waits for queued lazy compiles, later ones compile their modules again
         void Deinit();
 
         VulkanCore* GetCore() const;
 
+        //Pipeline creation times, split by whether the driver found the pipeline in the cache. Kept through Deinit for the caller to log.
+        struct PipelineCacheStats
+        {
+            size_t loadedBytes;         // 0 on a cold start
+            uint32_t pipelinesCreated;
+            uint32_t cacheHits;         // Reported through VK_EXT_pipeline_creation_feedback, without it every pipeline counts as a miss
+            double hitSeconds;
+            double missSeconds;
+        };
+        const PipelineCacheStats& GetPipelineCacheStats() const;
+
+        //Kept through Deinit like the cache stats
+        struct PipelineDedupStats
+        {
+            uint32_t requests;
+            uint32_t duplicatesAvoided; // Requests served by an existing pipeline with the same state
+        };
+        const PipelineDedupStats& GetPipelineDedupStats() const;
 
     private:
+        struct PipelineBuild
+        {
+            VkPipeline pipeline;
+            double seconds;
+            bool cacheHit;
+        };
+
         VkShaderModule CompileShader(const std::string& shaderFilename);
+        PipelineBuild BuildPipeline(VkShaderModule vertexShader, VkShaderModule fragmentShader, const DataLayout& dataLayout, bool transparent) const; // Safe on any thread
+        void RecordPipelineBuild(const PipelineBuild& build);
+        //Keyed on what the handles were made from, a destroyed module or layout's handle can come back for something else
+        std::string PipelineState(const std::string& vertexShaderFilename, const std::string& fragmentShaderFilename, const DataLayout& dataLayout, bool transparent) const;
+
+        struct LazyLayout
+        {
+            const DataLayout* dataLayout;
+            VkPipeline fallback;
+        };
+        struct LazyPipeline
+        {
+            PipelineKey key;
+            const LazyLayout* layout;   // Map nodes don't move
+            VkPipeline pipeline{ VK_NULL_HANDLE };
+            mutable bool used{ false }; // Set by GetPipeline, recorded for the warm-up file
+            bool warm{ false };         // Listed in the warm-up file, compiled whether or not it is drawn
+            bool queued{ false };       // Never requeued, so a permutation that fails to compile keeps the fallback
+        };
+        struct LazyBuild
+        {
+            uint32_t index;
+            std::string state;
+            PipelineBuild build;        // VK_NULL_HANDLE pipeline if the compile threw
+        };
+
+        void QueueLazyPipelines();
+        void PublishLazyPipelines();
+        void LoadWarmupList(std::vector<PipelineKey>& keys) const;
+        void SaveWarmupList() const;
+
+        void QueueCompile(std::function<void()> job); // On the core's worker pool
+        void WaitForCompiles();
+        void LoadPipelineCache();
+        void SavePipelineCache();
+        bool IsPipelineCacheCompatible(const std::vector<char>& data) const;
 
         std::map<KEngineCore::StringHash, VkShaderModule> mShaderModules;
-        std::map<KEngineCore::StringHash, VkPipeline> mGraphicsPipelines;
+        std::map<KEngineCore::StringHash, VkPipeline> mGraphicsPipelines;  // Several names can share one pipeline
+        std::map<std::string, VkPipeline> mPipelineStates;                  // Owns the pipelines, keyed on the full state bytes
         VulkanCore * mCore;
+        VkPipelineCache mPipelineCache{ VK_NULL_HANDLE };
+        std::string mPipelineCacheFilename;
+        PipelineCacheStats mPipelineCacheStats{};
+        PipelineDedupStats mPipelineDedupStats{};
+
+        std::map<std::string, LazyLayout> mLazyLayouts;
+        std::vector<LazyPipeline> mLazyPipelines;
+        std::map<PipelineKey, uint32_t> mLazyPipelineIndices;
+        std::vector<LazyBuild> mLazyBuilds; // Filled by the compile jobs
+        std::mutex mLazyBuildMutex;
+        uint32_t mPendingLazyPipelines{ 0 };
+        std::string mWarmupFilename;
+
+        uint32_t mPendingCompiles{ 0 };
+        std::mutex mCompileMutex;
+        std::condition_variable mCompileCondition;
     };
 }
@@ -10,7 +10,29 @@
 #include "ShaderFactory.h"
 #include "VulkanCore.h"
 #include <cassert>
+#include <cstring>
 #include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <random>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define KENGINE_CULL_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define KENGINE_CULL_SSE
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define KENGINE_MATRIX_SSE
+#endif
+
+static_assert(sizeof(KEngine2D::Matrix) == 16 * sizeof(float), "model matrices are written as 16 packed floats");
+
+static const size_t MIN_DRAWS_PER_RECORDING_THREAD = 256;
+static const uint32_t NO_EXACT_MATRIX = UINT32_MAX;
 
 
 #undef near
@@ -21,6 +43,9 @@ KEngineVulkan::SpriteGraphic::SpriteGraphic()
     mRenderer = nullptr;
     mTransform = nullptr;
     mSprite = nullptr;
+    mLayer = 0;
+    mPlainTransform = false;
+    SetUVRect(0.0f, 0.0f, 1.0f, 1.0f);
 }
 
 KEngineVulkan::SpriteGraphic::~SpriteGraphic()
@@ -37,101 +62,151 @@ void KEngineVulkan::SpriteGraphic::Init(SpriteRenderer* renderer, Sprite const*
     mTransform = transform;
     renderer->AddToRenderList(this);
 
-    VkDeviceSize bufferSize = 2 * sizeof(KEngine2D::Matrix); //This is gross hack, improve please
-    int maxFramesInFlight = renderer->GetCore()->getMaxFramesInFlight();
-    uniformBuffers.resize(maxFramesInFlight);
-
-    for (int i = 0; i < maxFramesInFlight; i++) {
-        renderer->GetCore()->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT, uniformBuffers[i].first, uniformBuffers[i].second);
-    }
-
     createDescriptorSets(renderer->GetCore(), sprite);
 }
 
 void KEngineVulkan::SpriteGraphic::Deinit()
 {
+    if (mRenderer == nullptr) {
+        return; // Never initialized
+    }
     VulkanCore* core = mRenderer->GetCore();
+    if (mRenderer->IsInRenderList(mRenderHandle)) {
+        mRenderer->RemoveFromRenderList(this);
+    }
 
-    for (auto& bufferPair : uniformBuffers) {
-        vmaDestroyBuffer(core->getAllocator(), bufferPair.first, bufferPair.second);
+    if (!descriptorSets.empty()) {
+        vkFreeDescriptorSets(core->getDevice(), core->getDescriptorPool(), descriptorSets.size(), &descriptorSets[0]);
+        descriptorSets.clear();
+        writtenTextures.clear();
+        writtenTextureVersions.clear();
+        writtenUniformGenerations.clear();
     }
-    vkFreeDescriptorSets(core->getDevice(), core->getDescriptorPool(), descriptorSets.size(), &descriptorSets[0]);
-    
-    std::vector<VkDescriptorSet> descriptorSets;
-    std::vector<std::pair<VkBuffer, VmaAllocation>> uniformBuffers;
 }
 
 void KEngineVulkan::SpriteGraphic::createDescriptorSets(KEngineVulkan::VulkanCore* core, const KEngineVulkan::Sprite* sprite)
 {
     int maxFramesInFlight = core->getMaxFramesInFlight();
+    const DataLayout* layout = sprite->mLayout;
+    if (!layout->hasObjectBindings()) {
+        return; // Everything comes from the view set and push constants
+    }
 
-    std::vector<VkDescriptorSetLayout> layouts(maxFramesInFlight, sprite->mLayout->getDescriptorSetLayout());
+    std::vector<VkDescriptorSetLayout> layouts(maxFramesInFlight, layout->getDescriptorSetLayout());
     VkDescriptorSetAllocateInfo allocInfo{};
     allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
     allocInfo.descriptorPool = core->getDescriptorPool();
     allocInfo.descriptorSetCount = static_cast<uint32_t>(maxFramesInFlight);
     allocInfo.pSetLayouts = layouts.data();
     descriptorSets.resize(maxFramesInFlight);
+    writtenTextures.assign(maxFramesInFlight, VK_NULL_HANDLE);
+    writtenTextureVersions.assign(maxFramesInFlight, 0);
+    writtenUniformGenerations.assign(maxFramesInFlight, 0);
     VkResult result = vkAllocateDescriptorSets(core->getDevice(), &allocInfo, descriptorSets.data());
     if (result != VK_SUCCESS) {
         throw std::runtime_error("failed to allocate descriptor sets!");
     }
 
     for (size_t i = 0; i < maxFramesInFlight; i++) {
-        VkDescriptorBufferInfo bufferInfo{};
-        bufferInfo.buffer = uniformBuffers[i].first;
-        bufferInfo.offset = 0;
-        bufferInfo.range = 2 * sizeof(KEngine2D::Matrix); // To do:  read this so it doesn't get out of sync
+        writeUniformDescriptor(core, static_cast<int>(i));
+        writeTextureDescriptor(core, static_cast<int>(i), sprite->GetTextureView());
+    }
+}
 
-        std::vector< VkWriteDescriptorSet> descriptorWrites;
+void KEngineVulkan::SpriteGraphic::refreshUniformBuffer(KEngineVulkan::VulkanCore* core, int currentFrame)
+{
+    if (!descriptorSets.empty() && writtenUniformGenerations[currentFrame] != core->getFrameUniformGeneration(currentFrame)) {
+        writeUniformDescriptor(core, currentFrame);
+    }
+}
 
-        VkWriteDescriptorSet uniformBufferWrite{};
-        uniformBufferWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        uniformBufferWrite.dstSet = descriptorSets[i];
-        uniformBufferWrite.dstBinding = 0;
-        uniformBufferWrite.dstArrayElement = 0;
-        uniformBufferWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-        uniformBufferWrite.descriptorCount = 1;
-        uniformBufferWrite.pBufferInfo = &bufferInfo;
+void KEngineVulkan::SpriteGraphic::writeUniformDescriptor(KEngineVulkan::VulkanCore* core, int frame)
+{
+    const DataLayout* layout = mSprite->mLayout;
+    writtenUniformGenerations[frame] = core->getFrameUniformGeneration(frame);
+    if (!layout->getUniformBufferBinding().has_value()) {
+        return;
+    }
 
-        descriptorWrites.push_back(uniformBufferWrite);
+    VkDescriptorBufferInfo bufferInfo{};
+    bufferInfo.buffer = core->getFrameUniformBuffer(frame);
+    bufferInfo.offset = 0;
+    bufferInfo.range = (layout->usesViewSet() ? 1 : 2) * sizeof(KEngine2D::Matrix); // To do:  read this so it doesn't get out of sync
 
-        if (sprite->textureImageView != VK_NULL_HANDLE)
-        {
-            VkDescriptorImageInfo imageInfo{};
-            imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-            imageInfo.imageView = sprite->textureImageView;
-            imageInfo.sampler = sprite->textureSampler;
+    VkWriteDescriptorSet uniformBufferWrite{};
+    uniformBufferWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    uniformBufferWrite.dstSet = descriptorSets[frame];
+    uniformBufferWrite.dstBinding = layout->getUniformBufferBinding().value();
+    uniformBufferWrite.dstArrayElement = 0;
+    uniformBufferWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    uniformBufferWrite.descriptorCount = 1;
+    uniformBufferWrite.pBufferInfo = &bufferInfo;
 
-            VkWriteDescriptorSet samplerWrite{};
-            samplerWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-            samplerWrite.dstSet = descriptorSets[i];
-            samplerWrite.dstBinding = 1;
-            samplerWrite.dstArrayElement = 0;
-            samplerWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-            samplerWrite.descriptorCount = 1;
-            samplerWrite.pImageInfo = &imageInfo;
+    vkUpdateDescriptorSets(core->getDevice(), 1, &uniformBufferWrite, 0, nullptr);
+}
 
-            descriptorWrites.push_back(samplerWrite);
-        }
+void KEngineVulkan::SpriteGraphic::refreshTexture(KEngineVulkan::VulkanCore* core, int currentFrame)
+{
+    //startFrame has waited on this frame's fence, so nothing in flight still reads this set
+    if (!descriptorSets.empty() && (writtenTextures[currentFrame] != mSprite->GetTextureView() || writtenTextureVersions[currentFrame] != mSprite->GetTextureVersion())) {
+        writeTextureDescriptor(core, currentFrame, mSprite->GetTextureView());
+    }
+}
 
-        vkUpdateDescriptorSets(core->getDevice(), static_cast<uint32_t>(descriptorWrites.size()), &descriptorWrites[0], 0, nullptr);
+void KEngineVulkan::SpriteGraphic::writeTextureDescriptor(KEngineVulkan::VulkanCore* core, int frame, VkImageView view)
+{
+    const DataLayout* layout = mSprite->mLayout;
+    if (view == VK_NULL_HANDLE || !layout->getSamplerBinding().has_value()) {
+        return;
     }
+
+    VkDescriptorImageInfo imageInfo{};
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    imageInfo.imageView = view;
+    imageInfo.sampler = mSprite->textureSampler;
+
+    VkWriteDescriptorSet samplerWrite{};
+    samplerWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    samplerWrite.dstSet = descriptorSets[frame];
+    samplerWrite.dstBinding = layout->getSamplerBinding().value();
+    samplerWrite.dstArrayElement = 0;
+    samplerWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    samplerWrite.descriptorCount = 1;
+    samplerWrite.pImageInfo = &imageInfo;
+
+    vkUpdateDescriptorSets(core->getDevice(), 1, &samplerWrite, 0, nullptr);
+    writtenTextures[frame] = view;
+    writtenTextureVersions[frame] = mSprite->GetTextureVersion();
+}
+
+VkImageView KEngineVulkan::Sprite::GetTextureView() const
+{
+    return textureFactory != nullptr ? textureFactory->GetTexture(texture) : textureImageView;
+}
+
+uint64_t KEngineVulkan::Sprite::GetTextureVersion() const
+{
+    return textureFactory != nullptr ? textureFactory->GetTextureVersion(texture) : 0;
+}
+
+VkPipeline KEngineVulkan::Sprite::GetPipeline() const
+{
+    return shaderFactory != nullptr ? shaderFactory->GetPipeline(pipeline) : graphicsPipeline;
 }
 
-void KEngineVulkan::SpriteGraphic::updateUniformBuffer(int currentFrame, const KEngine2D::Matrix & projectionMatrix)
+uint32_t KEngineVulkan::SpriteGraphic::updateUniformBuffer(const KEngine2D::Matrix & modelMatrix, const KEngine2D::Matrix & projectionMatrix)
 {
     struct Ubo {
         KEngine2D::Matrix model;
         KEngine2D::Matrix projection;
     };
-    Ubo ubo{ mTransform->GetAsMatrix(), projectionMatrix };
-    
-    void* data;
-    VmaAllocator allocator = mRenderer->GetCore()->getAllocator();
-    vmaMapMemory(allocator, uniformBuffers[currentFrame].second, &data);
-    memcpy(data, &ubo, sizeof(ubo));
-    vmaUnmapMemory(allocator, uniformBuffers[currentFrame].second);
+    Ubo ubo{ modelMatrix, projectionMatrix };
+
+    //The projection comes from the view set when the layout has one
+    size_t uboSize = mSprite->mLayout->usesViewSet() ? sizeof(KEngine2D::Matrix) : sizeof(ubo);
+    VulkanCore::FrameUniformAllocation allocation = mRenderer->GetCore()->allocateFrameUniforms(uboSize);
+    memcpy(allocation.data, &ubo, uboSize);
+    return allocation.offset;
 }
 
 KEngineVulkan::Sprite const* KEngineVulkan::SpriteGraphic::GetSprite() const
@@ -151,6 +226,49 @@ KEngine2D::Transform const* KEngineVulkan::SpriteGraphic::GetTransform() const
     return mTransform;
 }
 
+void KEngineVulkan::SpriteGraphic::SetLayer(uint8_t layer)
+{
+    mLayer = layer;
+}
+
+uint8_t KEngineVulkan::SpriteGraphic::GetLayer() const
+{
+    return mLayer;
+}
+
+void KEngineVulkan::SpriteGraphic::SetPlainTransform(bool plain)
+{
+    mPlainTransform = plain;
+}
+
+bool KEngineVulkan::SpriteGraphic::HasPlainTransform() const
+{
+    return mPlainTransform;
+}
+
+void KEngineVulkan::SpriteGraphic::SetUVRect(float u0, float v0, float u1, float v1)
+{
+    mUvTransform[0] = u0;
+    mUvTransform[1] = v0;
+    mUvTransform[2] = u1 - u0;
+    mUvTransform[3] = v1 - v0;
+}
+
+void KEngineVulkan::SpriteGraphic::SetUVRect(const TextureFactory::AtlasRegion& region)
+{
+    SetUVRect(region.u0, region.v0, region.u1, region.v1);
+}
+
+const float* KEngineVulkan::SpriteGraphic::GetUVTransform() const
+{
+    return mUvTransform;
+}
+
+KEngineVulkan::RenderHandle KEngineVulkan::SpriteGraphic::GetRenderHandle() const
+{
+    return mRenderHandle;
+}
+
 VkDescriptorSet KEngineVulkan::SpriteGraphic::GetDescriptorSet(int currentFrame) const
 {
     return descriptorSets[currentFrame];
@@ -159,6 +277,11 @@ VkDescriptorSet KEngineVulkan::SpriteGraphic::GetDescriptorSet(int currentFrame)
 KEngineVulkan::SpriteRenderer::SpriteRenderer()
 {
     mInitialized = false;
+    mNextRenderSequence = 0;
+    mCullingEnabled = true;
+    mStaticCellSize = 256.0f;
+    mStaticMaxExtent = 0.0f;
+    mStaticMaxExtentStale = false;
 }
 
 KEngineVulkan::SpriteRenderer::~SpriteRenderer()
@@ -202,14 +325,69 @@ void KEngineVulkan::SpriteRenderer::Init(VulkanCore* core, int width, int height
     mProjection.data[3][2] = -(far + near) / (far - near);
     mProjection.data[3][3] = 1.0f;
 
+    int maxFramesInFlight = core->getMaxFramesInFlight();
+    std::vector<VkDescriptorSetLayout> layouts(maxFramesInFlight, core->getViewDescriptorSetLayout());
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = core->getDescriptorPool();
+    allocInfo.descriptorSetCount = static_cast<uint32_t>(maxFramesInFlight);
+    allocInfo.pSetLayouts = layouts.data();
+    mViewDescriptorSets.resize(maxFramesInFlight);
+    if (vkAllocateDescriptorSets(core->getDevice(), &allocInfo, mViewDescriptorSets.data()) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate view descriptor sets!");
+    }
+
+    mViewSetGenerations.assign(maxFramesInFlight, 0);
+    for (int i = 0; i < maxFramesInFlight; i++) {
+        WriteViewDescriptor(i);
+    }
 
+    mStartTime = std::chrono::steady_clock::now();
     mInitialized = true;
 }
 
 void KEngineVulkan::SpriteRenderer::Deinit()
 {
+    for (auto& bufferPair : mInstanceBuffers) {
+        if (bufferPair.first != VK_NULL_HANDLE) {
+            vmaDestroyBuffer(mCore->getAllocator(), bufferPair.first, bufferPair.second);
+        }
+    }
+    mInstanceBuffers.clear();
+    mInstanceData.clear();
+    mInstanceUvData.clear();
+    mInstanceCapacities.clear();
+    if (!mViewDescriptorSets.empty()) {
+        vkFreeDescriptorSets(mCore->getDevice(), mCore->getDescriptorPool(), static_cast<uint32_t>(mViewDescriptorSets.size()), mViewDescriptorSets.data());
+        mViewDescriptorSets.clear();
+    }
+    mBatches.clear();
     mInitialized = false;
+    //Bump the generation of every live slot so handles held by graphics go stale
+    for (const RenderEntry& entry : mRenderList)
+    {
+        if (++mRenderSlots[entry.slot].generation == 0)
+        {
+            mRenderSlots[entry.slot].generation = 1;
+        }
+        mFreeRenderSlots.push_back(entry.slot);
+        entry.graphic->mRenderHandle = RenderHandle();
+    }
     mRenderList.clear();
+    for (const StaticEntry& staticEntry : mStaticList)
+    {
+        if (++mRenderSlots[staticEntry.entry.slot].generation == 0)
+        {
+            mRenderSlots[staticEntry.entry.slot].generation = 1;
+        }
+        mFreeRenderSlots.push_back(staticEntry.entry.slot);
+        staticEntry.entry.graphic->mRenderHandle = RenderHandle();
+    }
+    mStaticList.clear();
+    mStaticCells.clear();
+    mStaticOversized.clear();
+    mStaticMaxExtent = 0.0f;
+    mStaticMaxExtentStale = false;
 }
 
 void KEngineVulkan::SpriteRenderer::Render() const
@@ -225,22 +403,96 @@ void KEngineVulkan::SpriteRenderer::Render() const
     int currentFrame = mCore->getCurrentFrame();
     assert(currentFrame >= 0);
     VkCommandBuffer commandBuffer = mCore->getCommandBuffer();
-   
-    for (SpriteGraphic* graphic : mRenderList)
+
+    mRenderStats = {};
+    GatherTransforms();
+    CullRenderList();
+    SortRenderList();
+    BuildBatches();
+
+    //Room for the view and every object uniform this frame can allocate, so the arena never runs out mid-recording
+    VkDeviceSize uniformBytes = mCore->alignFrameUniformSize(sizeof(ViewUniforms));
+    for (const SortEntry& entry : mSortEntries)
+    {
+        if (entry.graphic->GetSprite()->mLayout->getUniformBufferBinding().has_value())
+        {
+            uniformBytes += mCore->alignFrameUniformSize(2 * sizeof(KEngine2D::Matrix));
+        }
+    }
+    mCore->reserveFrameUniforms(uniformBytes);
+    if (mViewSetGenerations[currentFrame] != mCore->getFrameUniformGeneration(currentFrame))
     {
+        WriteViewDescriptor(currentFrame);
+    }
 
-        const Sprite* sprite = graphic->GetSprite();
-        graphic->updateUniformBuffer(currentFrame, mProjection);
+    //Streamed textures may have swapped views, and the uniform arena may have grown, since this frame's sets were last written
+    for (const SortEntry& entry : mSortEntries)
+    {
+        entry.graphic->refreshTexture(mCore, currentFrame);
+        entry.graphic->refreshUniformBuffer(mCore, currentFrame);
+    }
 
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,sprite->graphicsPipeline);
-        VkBuffer vertexBuffers[] = { sprite->vertexBuffer.first };
-        VkDeviceSize offsets[] = { 0 };
-        vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+    //Every visible graphic gets its model matrix in the instance buffer at its draw position, written in one vectorized pass.
+    //Instanced batches read them as a vertex stream, the rest copy theirs into push constants or frame uniforms
+    size_t instanceCount = mSortEntries.size();
+    KEngine2D::Matrix* instances = ReserveInstances(currentFrame, instanceCount);
+    WriteModelMatrices(instances);
+    if (mWriteInstanceUvs)
+    {
+        float* uvs = mInstanceUvData[currentFrame];
+        for (size_t position = 0; position < mSortEntries.size(); position++)
+        {
+            memcpy(uvs + position * 4, mSortEntries[position].graphic->GetUVTransform(), 4 * sizeof(float));
+        }
+    }
+
+    uint32_t viewOffset = UpdateViewUniforms();
 
-        vkCmdBindIndexBuffer(commandBuffer, sprite->indexBuffer.first, 0, VK_INDEX_TYPE_UINT16);
-        VkDescriptorSet descriptorSet = graphic->GetDescriptorSet(currentFrame);
-        vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, sprite->mLayout->getPipelineLayout(), 0, 1, &descriptorSet, 0, nullptr);
-        vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(sprite->indexCount), 1, 0, 0, 0);
+    //Split the batches into one contiguous run per recording thread, each recorded with its own bind state
+    uint32_t threadCount = mCore->getRecordingThreadCount();
+    size_t drawCount = mSortEntries.size();
+    uint32_t chunkCount = static_cast<uint32_t>(std::min<size_t>(threadCount, std::max<size_t>(drawCount / MIN_DRAWS_PER_RECORDING_THREAD, 1)));
+    if (chunkCount <= 1)
+    {
+        RecordState state;
+        RecordBatches(commandBuffer, currentFrame, 0, mBatches.size(), viewOffset, instances, state);
+        mRenderStats += state.stats;
+    }
+    else
+    {
+        //Chunk boundaries fall on batches, balanced by the number of graphics each covers
+        mChunkStarts.assign(1, 0);
+        size_t drawsPerChunk = (drawCount + chunkCount - 1) / chunkCount;
+        size_t draws = 0;
+        for (size_t batchIndex = 0; batchIndex < mBatches.size(); batchIndex++)
+        {
+            if (draws >= drawsPerChunk * mChunkStarts.size() && mChunkStarts.size() < chunkCount)
+            {
+                mChunkStarts.push_back(batchIndex);
+            }
+            draws += mBatches[batchIndex].graphics.size();
+        }
+        mChunkStarts.push_back(mBatches.size());
+        chunkCount = static_cast<uint32_t>(mChunkStarts.size() - 1);
+
+        mRecordStates.assign(chunkCount, RecordState());
+        mCore->recordSecondaryCommandBuffers(chunkCount, [&](uint32_t index, VkCommandBuffer secondary)
+        {
+            RecordBatches(secondary, currentFrame, mChunkStarts[index], mChunkStarts[index + 1], viewOffset, instances, mRecordStates[index]);
+        });
+        for (const RecordState& state : mRecordStates)
+        {
+            mRenderStats += state.stats;
+        }
+    }
+
+    if (instanceCount > 0)
+    {
+        vmaFlushAllocation(mCore->getAllocator(), mInstanceBuffers[currentFrame].second, 0, instanceCount * sizeof(KEngine2D::Matrix));
+        if (mWriteInstanceUvs)
+        {
+            vmaFlushAllocation(mCore->getAllocator(), mInstanceBuffers[currentFrame].second, mInstanceCapacities[currentFrame] * sizeof(KEngine2D::Matrix), instanceCount * 4 * sizeof(float));
+        }
     }
 
     if (selfStarter)
@@ -249,16 +501,963 @@ void KEngineVulkan::SpriteRenderer::Render() const
     }
 }
 
+void KEngineVulkan::SpriteRenderer::RecordBatches(VkCommandBuffer commandBuffer, int currentFrame, size_t firstBatch, size_t lastBatch, uint32_t viewOffset, KEngine2D::Matrix* instances, RecordState& state) const
+{
+    //Runs on recording threads, so it only writes to state, its own instance range and freshly allocated frame uniforms
+    if (mScissor)
+    {
+        vkCmdSetScissor(commandBuffer, 0, 1, &*mScissor);
+    }
+    for (size_t batchIndex = firstBatch; batchIndex < lastBatch; batchIndex++)
+    {
+        const Batch& batch = mBatches[batchIndex];
+        const Sprite* sprite = batch.sprite;
+        const DataLayout* layout = sprite->mLayout;
+
+        //Batches arrive in state order, so most of these match what the previous batch left bound
+        if (batch.key.pipeline != state.pipeline)
+        {
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, batch.key.pipeline);
+            state.pipeline = batch.key.pipeline;
+            state.stats.pipelineBinds++;
+        }
+        else
+        {
+            state.stats.pipelineBindsSkipped++;
+        }
+        if (sprite->vertexBuffer.first != state.vertexBuffer)
+        {
+            VkBuffer vertexBuffers[] = { sprite->vertexBuffer.first };
+            VkDeviceSize offsets[] = { 0 };
+            vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+            state.vertexBuffer = sprite->vertexBuffer.first;
+            state.stats.vertexBufferBinds++;
+        }
+        else
+        {
+            state.stats.vertexBufferBindsSkipped++;
+        }
+        if (sprite->indexBuffer.first != state.indexBuffer)
+        {
+            vkCmdBindIndexBuffer(commandBuffer, sprite->indexBuffer.first, 0, VK_INDEX_TYPE_UINT16);
+            state.indexBuffer = sprite->indexBuffer.first;
+            state.stats.indexBufferBinds++;
+        }
+        else
+        {
+            state.stats.indexBufferBindsSkipped++;
+        }
+
+        //The view set stays bound until its slot is taken or the layout changes
+        if (layout->usesViewSet())
+        {
+            if (state.sets[0] != mViewDescriptorSets[currentFrame] || state.setLayouts[0] != layout->getPipelineLayout())
+            {
+                state.BindSet(commandBuffer, layout->getPipelineLayout(), 0, mViewDescriptorSets[currentFrame], 1, &viewOffset);
+            }
+            else
+            {
+                state.stats.descriptorSetBindsSkipped++;
+            }
+        }
+
+        if (layout->hasInstanceBinding())
+        {
+            //Every graphic in the batch shares the texture, and the projection is the same for all of them,
+            //so the first graphic's descriptor set serves the whole batch
+            SpriteGraphic* first = batch.graphics.front();
+            BindObjectSet(commandBuffer, currentFrame, first, instances[batch.firstInstance], layout, state);
+
+            VkBuffer instanceBuffer = mInstanceBuffers[currentFrame].first;
+            VkDeviceSize instanceOffset = batch.firstInstance * sizeof(KEngine2D::Matrix);
+            vkCmdBindVertexBuffers(commandBuffer, layout->getInstanceBinding(), 1, &instanceBuffer, &instanceOffset);
+            if (layout->hasInstanceUvBinding())
+            {
+                VkDeviceSize uvOffset = mInstanceCapacities[currentFrame] * sizeof(KEngine2D::Matrix) + batch.firstInstance * 4 * sizeof(float);
+                vkCmdBindVertexBuffers(commandBuffer, layout->getInstanceUvBinding(), 1, &instanceBuffer, &uvOffset);
+            }
+            vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(sprite->indexCount), static_cast<uint32_t>(batch.graphics.size()), 0, 0, 0);
+            state.stats.drawCalls++;
+        }
+        else
+        {
+            for (size_t i = 0; i < batch.graphics.size(); i++)
+            {
+                const KEngine2D::Matrix& model = instances[batch.firstInstance + i];
+                BindObjectSet(commandBuffer, currentFrame, batch.graphics[i], model, layout, state);
+                if (layout->hasUvPushConstant())
+                {
+                    struct
+                    {
+                        KEngine2D::Matrix model;
+                        float uvTransform[4];
+                    } pushed;
+                    pushed.model = model;
+                    memcpy(pushed.uvTransform, batch.graphics[i]->GetUVTransform(), sizeof(pushed.uvTransform));
+                    vkCmdPushConstants(commandBuffer, layout->getPipelineLayout(), layout->getModelPushConstantStages(), 0, sizeof(pushed), &pushed);
+                }
+                else if (layout->hasModelPushConstant())
+                {
+                    vkCmdPushConstants(commandBuffer, layout->getPipelineLayout(), layout->getModelPushConstantStages(), 0, sizeof(model), &model);
+                }
+                vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(sprite->indexCount), 1, 0, 0, 0);
+                state.stats.drawCalls++;
+            }
+        }
+    }
+
+    if (mScissor)
+    {
+        //The frame's inline buffer carries on to whatever draws next
+        mCore->setFullViewport(commandBuffer);
+    }
+}
+
+void KEngineVulkan::SpriteRenderer::BindObjectSet(VkCommandBuffer commandBuffer, int currentFrame, SpriteGraphic* graphic, const KEngine2D::Matrix& model, const DataLayout* layout, RecordState& state) const
+{
+    if (!layout->hasObjectBindings())
+    {
+        return;
+    }
+    uint32_t uniformOffset = 0;
+    uint32_t dynamicOffsetCount = 0;
+    if (layout->getUniformBufferBinding().has_value())
+    {
+        uniformOffset = graphic->updateUniformBuffer(model, mProjection);
+        dynamicOffsetCount = 1;
+    }
+    VkDescriptorSet descriptorSet = graphic->GetDescriptorSet(currentFrame);
+    uint32_t slot = layout->getObjectSetIndex();
+    //A set with a dynamic offset moves every draw, only static sets can be left bound
+    if (dynamicOffsetCount == 0 && descriptorSet == state.sets[slot] && layout->getPipelineLayout() == state.setLayouts[slot])
+    {
+        state.stats.descriptorSetBindsSkipped++;
+        return;
+    }
+    state.BindSet(commandBuffer, layout->getPipelineLayout(), slot, descriptorSet, dynamicOffsetCount, &uniformOffset);
+}
+
+void KEngineVulkan::SpriteRenderer::RecordState::BindSet(VkCommandBuffer commandBuffer, VkPipelineLayout layout, uint32_t slot, VkDescriptorSet set, uint32_t dynamicOffsetCount, const uint32_t* dynamicOffsets)
+{
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, slot, 1, &set, dynamicOffsetCount, dynamicOffsets);
+    //Layouts differ in push constant ranges, which makes them incompatible, so only slots bound with this same layout are still valid
+    for (uint32_t other = 0; other < 2; other++)
+    {
+        if (other != slot && setLayouts[other] != layout)
+        {
+            sets[other] = VK_NULL_HANDLE;
+            setLayouts[other] = VK_NULL_HANDLE;
+        }
+    }
+    sets[slot] = set;
+    setLayouts[slot] = layout;
+    stats.descriptorSetBinds++;
+}
+
+void KEngineVulkan::SpriteRenderer::WriteViewDescriptor(int frame) const
+{
+    VkDescriptorBufferInfo bufferInfo{};
+    bufferInfo.buffer = mCore->getFrameUniformBuffer(frame);
+    bufferInfo.offset = 0;
+    bufferInfo.range = sizeof(ViewUniforms);
+
+    VkWriteDescriptorSet uniformBufferWrite{};
+    uniformBufferWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    uniformBufferWrite.dstSet = mViewDescriptorSets[frame];
+    uniformBufferWrite.dstBinding = 0;
+    uniformBufferWrite.dstArrayElement = 0;
+    uniformBufferWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    uniformBufferWrite.descriptorCount = 1;
+    uniformBufferWrite.pBufferInfo = &bufferInfo;
+
+    vkUpdateDescriptorSets(mCore->getDevice(), 1, &uniformBufferWrite, 0, nullptr);
+    mViewSetGenerations[frame] = mCore->getFrameUniformGeneration(frame);
+}
+
+uint32_t KEngineVulkan::SpriteRenderer::UpdateViewUniforms() const
+{
+    ViewUniforms view{};
+    view.projection = mProjection;
+    view.viewport[0] = 0.0f;
+    view.viewport[1] = 0.0f;
+    view.viewport[2] = (float)mWidth;
+    view.viewport[3] = (float)mHeight;
+    view.time = std::chrono::duration<float>(std::chrono::steady_clock::now() - mStartTime).count();
+
+    VulkanCore::FrameUniformAllocation allocation = mCore->allocateFrameUniforms(sizeof(view));
+    memcpy(allocation.data, &view, sizeof(view));
+    return allocation.offset;
+}
+
+//Stable LSD radix sort on the 64 bit key, one byte per pass; passes where every key shares the byte are skipped
+void KEngineVulkan::SpriteRenderer::RadixSort(std::vector<SortEntry>& entries, std::vector<SortEntry>& scratch)
+{
+    size_t counts[8][256] = {};
+    for (const auto& entry : entries)
+    {
+        for (int pass = 0; pass < 8; pass++)
+        {
+            counts[pass][(entry.key >> (pass * 8)) & 0xFF]++;
+        }
+    }
+
+    scratch.resize(entries.size());
+    for (int pass = 0; pass < 8; pass++)
+    {
+        size_t* passCounts = counts[pass];
+        if (passCounts[(entries.front().key >> (pass * 8)) & 0xFF] == entries.size())
+        {
+            continue;
+        }
+        size_t offset = 0;
+        for (int bucket = 0; bucket < 256; bucket++)
+        {
+            size_t count = passCounts[bucket];
+            passCounts[bucket] = offset;
+            offset += count;
+        }
+        for (const auto& entry : entries)
+        {
+            scratch[passCounts[(entry.key >> (pass * 8)) & 0xFF]++] = entry;
+        }
+        entries.swap(scratch);
+    }
+}
+
+//Ids are handed out in order of first appearance this frame, so equal states sort together without depending on handle values
+static uint64_t StateId(std::unordered_map<uint64_t, uint64_t>& ids, uint64_t handle, uint64_t mask)
+{
+    auto found = ids.emplace(handle, ids.size());
+    return std::min(found.first->second, mask);
+}
+
+//Sine and cosine of every angle, four at a time where the target allows.
+//Cephes style: reduce to a quarter turn around zero, evaluate both minimax polynomials, then pick and sign by quadrant.
+static void SinCos(const float* angles, size_t count, float* sines, float* cosines)
+{
+    size_t i = 0;
+#if defined(KENGINE_MATRIX_SSE)
+    const __m128 twoOverPi = _mm_set1_ps(0.63661977236758134f);
+    const __m128 halfPi1 = _mm_set1_ps(1.5703125f);
+    const __m128 halfPi2 = _mm_set1_ps(4.837512969970703125e-4f);
+    const __m128 halfPi3 = _mm_set1_ps(7.54978995489188216e-8f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128i oneBit = _mm_set1_epi32(1);
+    const __m128i twoBit = _mm_set1_epi32(2);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(angles + i);
+        __m128i quadrant = _mm_cvtps_epi32(_mm_mul_ps(x, twoOverPi));
+        __m128 q = _mm_cvtepi32_ps(quadrant);
+        __m128 r = _mm_sub_ps(x, _mm_mul_ps(q, halfPi1));
+        r = _mm_sub_ps(r, _mm_mul_ps(q, halfPi2));
+        r = _mm_sub_ps(r, _mm_mul_ps(q, halfPi3));
+        __m128 r2 = _mm_mul_ps(r, r);
+
+        __m128 sinPoly = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(-1.9515295891e-4f), r2), _mm_set1_ps(8.3321608736e-3f));
+        sinPoly = _mm_add_ps(_mm_mul_ps(sinPoly, r2), _mm_set1_ps(-1.6666654611e-1f));
+        sinPoly = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(sinPoly, r2), r), r);
+
+        __m128 cosPoly = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.443315711809948e-5f), r2), _mm_set1_ps(-1.388731625493765e-3f));
+        cosPoly = _mm_add_ps(_mm_mul_ps(cosPoly, r2), _mm_set1_ps(4.166664568298827e-2f));
+        cosPoly = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(cosPoly, r2), r2), _mm_sub_ps(one, _mm_mul_ps(half, r2)));
+
+        //Odd quadrants swap the polynomials, quadrants 2 and 3 negate the sine, 1 and 2 negate the cosine
+        __m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(quadrant, oneBit), oneBit));
+        __m128 sine = _mm_or_ps(_mm_and_ps(swap, cosPoly), _mm_andnot_ps(swap, sinPoly));
+        __m128 cosine = _mm_or_ps(_mm_and_ps(swap, sinPoly), _mm_andnot_ps(swap, cosPoly));
+        __m128 sineSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(quadrant, twoBit), 30));
+        __m128 cosineSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(_mm_add_epi32(quadrant, oneBit), twoBit), 30));
+        _mm_storeu_ps(sines + i, _mm_xor_ps(sine, sineSign));
+        _mm_storeu_ps(cosines + i, _mm_xor_ps(cosine, cosineSign));
+    }
+#endif
+    for (; i < count; i++)
+    {
+        sines[i] = std::sin(angles[i]);
+        cosines[i] = std::cos(angles[i]);
+    }
+}
+
+//Linear part of plain translate-rotate-scale transforms, (cos, sin) * scale in column 0 and (-sin, cos) * scale in column 1
+static void PlainLinearParts(const float* rotation, const float* scale, size_t count, float* linear00, float* linear01, float* linear10, float* linear11)
+{
+    SinCos(rotation, count, linear01, linear00);
+    for (size_t i = 0; i < count; i++)
+    {
+        float c = linear00[i] * scale[i];
+        float s = linear01[i] * scale[i];
+        linear00[i] = c;
+        linear01[i] = s;
+        linear10[i] = -s;
+        linear11[i] = c;
+    }
+}
+
+//Writes column-major 2D affine matrices, transform indices[k] going to matrices[k].
+//The linear part is (linear00, linear01) in column 0 and (linear10, linear11) in column 1.
+static void ComposeModelMatrices(const float* translationX, const float* translationY, const float* linear00, const float* linear01, const float* linear10, const float* linear11,
+    const uint32_t* indices, size_t count, KEngine2D::Matrix* matrices)
+{
+    float* out = reinterpret_cast<float*>(matrices);
+    size_t k = 0;
+#if defined(KENGINE_MATRIX_SSE)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 column2 = _mm_setr_ps(0.0f, 0.0f, 1.0f, 0.0f);
+    const __m128 column3Tail = _mm_setr_ps(0.0f, 1.0f, 0.0f, 1.0f);
+    for (; k + 4 <= count; k += 4)
+    {
+        uint32_t i0 = indices[k], i1 = indices[k + 1], i2 = indices[k + 2], i3 = indices[k + 3];
+        __m128 a = _mm_setr_ps(linear00[i0], linear00[i1], linear00[i2], linear00[i3]);
+        __m128 b = _mm_setr_ps(linear01[i0], linear01[i1], linear01[i2], linear01[i3]);
+        __m128 c = _mm_setr_ps(linear10[i0], linear10[i1], linear10[i2], linear10[i3]);
+        __m128 d = _mm_setr_ps(linear11[i0], linear11[i1], linear11[i2], linear11[i3]);
+        __m128 tx = _mm_setr_ps(translationX[i0], translationX[i1], translationX[i2], translationX[i3]);
+        __m128 ty = _mm_setr_ps(translationY[i0], translationY[i1], translationY[i2], translationY[i3]);
+
+        //Interleave the lanes into per-matrix pairs, then pad each pair out to a column
+        __m128 ab01 = _mm_unpacklo_ps(a, b), ab23 = _mm_unpackhi_ps(a, b);
+        __m128 cd01 = _mm_unpacklo_ps(c, d), cd23 = _mm_unpackhi_ps(c, d);
+        __m128 t01 = _mm_unpacklo_ps(tx, ty), t23 = _mm_unpackhi_ps(tx, ty);
+
+        float* m = out + k * 16;
+        _mm_storeu_ps(m + 0, _mm_movelh_ps(ab01, zero));
+        _mm_storeu_ps(m + 4, _mm_movelh_ps(cd01, zero));
+        _mm_storeu_ps(m + 8, column2);
+        _mm_storeu_ps(m + 12, _mm_movelh_ps(t01, column3Tail));
+        m += 16;
+        _mm_storeu_ps(m + 0, _mm_movehl_ps(zero, ab01));
+        _mm_storeu_ps(m + 4, _mm_movehl_ps(zero, cd01));
+        _mm_storeu_ps(m + 8, column2);
+        _mm_storeu_ps(m + 12, _mm_movehl_ps(column3Tail, t01));
+        m += 16;
+        _mm_storeu_ps(m + 0, _mm_movelh_ps(ab23, zero));
+        _mm_storeu_ps(m + 4, _mm_movelh_ps(cd23, zero));
+        _mm_storeu_ps(m + 8, column2);
+        _mm_storeu_ps(m + 12, _mm_movelh_ps(t23, column3Tail));
+        m += 16;
+        _mm_storeu_ps(m + 0, _mm_movehl_ps(zero, ab23));
+        _mm_storeu_ps(m + 4, _mm_movehl_ps(zero, cd23));
+        _mm_storeu_ps(m + 8, column2);
+        _mm_storeu_ps(m + 12, _mm_movehl_ps(column3Tail, t23));
+    }
+#endif
+    for (; k < count; k++)
+    {
+        uint32_t i = indices[k];
+        float* m = out + k * 16;
+        const float matrix[16] = {
+            linear00[i], linear01[i], 0.0f, 0.0f,
+            linear10[i], linear11[i], 0.0f, 0.0f,
+            0.0f, 0.0f, 1.0f, 0.0f,
+            translationX[i], translationY[i], 0.0f, 1.0f
+        };
+        memcpy(m, matrix, sizeof(matrix));
+    }
+}
+
+//Tests each sprite's world box against the view rectangle, writing 1 for overlapping entries, eight or four at a time where the target allows.
+//The box is the sprite rectangle either side of the translation pushed through the linear part. Returns the number of visible entries.
+static size_t CullBounds(const float* translationX, const float* translationY, const float* linear00, const float* linear01, const float* linear10, const float* linear11,
+    const float* spriteWidth, const float* spriteHeight, size_t count, float width, float height, uint8_t* visible)
+{
+    size_t visibleCount = 0;
+    size_t i = 0;
+#if defined(KENGINE_CULL_AVX)
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 right = _mm256_set1_ps(width);
+    const __m256 bottom = _mm256_set1_ps(height);
+    const __m256 signBit = _mm256_set1_ps(-0.0f);
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 cx = _mm256_loadu_ps(translationX + i);
+        __m256 cy = _mm256_loadu_ps(translationY + i);
+        __m256 a = _mm256_andnot_ps(signBit, _mm256_loadu_ps(linear00 + i));
+        __m256 b = _mm256_andnot_ps(signBit, _mm256_loadu_ps(linear01 + i));
+        __m256 c = _mm256_andnot_ps(signBit, _mm256_loadu_ps(linear10 + i));
+        __m256 d = _mm256_andnot_ps(signBit, _mm256_loadu_ps(linear11 + i));
+        __m256 w = _mm256_loadu_ps(spriteWidth + i);
+        __m256 h = _mm256_loadu_ps(spriteHeight + i);
+        __m256 ex = _mm256_add_ps(_mm256_mul_ps(a, w), _mm256_mul_ps(c, h));
+        __m256 ey = _mm256_add_ps(_mm256_mul_ps(b, w), _mm256_mul_ps(d, h));
+        __m256 inside = _mm256_and_ps(
+            _mm256_and_ps(_mm256_cmp_ps(_mm256_add_ps(cx, ex), zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_sub_ps(cx, ex), right, _CMP_LE_OQ)),
+            _mm256_and_ps(_mm256_cmp_ps(_mm256_add_ps(cy, ey), zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_sub_ps(cy, ey), bottom, _CMP_LE_OQ)));
+        int mask = _mm256_movemask_ps(inside);
+        for (int lane = 0; lane < 8; lane++)
+        {
+            visible[i + lane] = (mask >> lane) & 1;
+            visibleCount += (mask >> lane) & 1;
+        }
+    }
+#elif defined(KENGINE_CULL_SSE)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 right = _mm_set1_ps(width);
+    const __m128 bottom = _mm_set1_ps(height);
+    const __m128 signBit = _mm_set1_ps(-0.0f);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 cx = _mm_loadu_ps(translationX + i);
+        __m128 cy = _mm_loadu_ps(translationY + i);
+        __m128 a = _mm_andnot_ps(signBit, _mm_loadu_ps(linear00 + i));
+        __m128 b = _mm_andnot_ps(signBit, _mm_loadu_ps(linear01 + i));
+        __m128 c = _mm_andnot_ps(signBit, _mm_loadu_ps(linear10 + i));
+        __m128 d = _mm_andnot_ps(signBit, _mm_loadu_ps(linear11 + i));
+        __m128 w = _mm_loadu_ps(spriteWidth + i);
+        __m128 h = _mm_loadu_ps(spriteHeight + i);
+        __m128 ex = _mm_add_ps(_mm_mul_ps(a, w), _mm_mul_ps(c, h));
+        __m128 ey = _mm_add_ps(_mm_mul_ps(b, w), _mm_mul_ps(d, h));
+        __m128 inside = _mm_and_ps(
+            _mm_and_ps(_mm_cmpge_ps(_mm_add_ps(cx, ex), zero), _mm_cmple_ps(_mm_sub_ps(cx, ex), right)),
+            _mm_and_ps(_mm_cmpge_ps(_mm_add_ps(cy, ey), zero), _mm_cmple_ps(_mm_sub_ps(cy, ey), bottom)));
+        int mask = _mm_movemask_ps(inside);
+        for (int lane = 0; lane < 4; lane++)
+        {
+            visible[i + lane] = (mask >> lane) & 1;
+            visibleCount += (mask >> lane) & 1;
+        }
+    }
+#endif
+    for (; i < count; i++)
+    {
+        float ex = std::abs(linear00[i]) * spriteWidth[i] + std::abs(linear10[i]) * spriteHeight[i];
+        float ey = std::abs(linear01[i]) * spriteWidth[i] + std::abs(linear11[i]) * spriteHeight[i];
+        bool inside = translationX[i] + ex >= 0.0f && translationX[i] - ex <= width
+            && translationY[i] + ey >= 0.0f && translationY[i] - ey <= height;
+        visible[i] = inside ? 1 : 0;
+        visibleCount += inside ? 1 : 0;
+    }
+    return visibleCount;
+}
+
+void KEngineVulkan::SpriteRenderer::GatherStatics() const
+{
+    //Only cells whose loose bounds can reach the view are visited, their contents are culled exactly along with everything else
+    mStaticCandidates.clear();
+    if (mStaticList.empty())
+    {
+        return;
+    }
+    if (!mCullingEnabled)
+    {
+        for (uint32_t i = 0; i < mStaticList.size(); i++)
+        {
+            mStaticCandidates.push_back(i);
+        }
+        mRenderStats.staticCandidates = static_cast<uint32_t>(mStaticCandidates.size());
+        return;
+    }
+
+    if (mStaticMaxExtentStale)
+    {
+        mStaticMaxExtent = 0.0f;
+        for (const StaticEntry& staticEntry : mStaticList)
+        {
+            if (!staticEntry.oversized)
+            {
+                mStaticMaxExtent = std::max(mStaticMaxExtent, staticEntry.halfExtent);
+            }
+        }
+        mStaticMaxExtentStale = false;
+    }
+
+    int32_t firstX = (int32_t)std::floor(-mStaticMaxExtent / mStaticCellSize);
+    int32_t lastX = (int32_t)std::floor((mWidth + mStaticMaxExtent) / mStaticCellSize);
+    int32_t firstY = (int32_t)std::floor(-mStaticMaxExtent / mStaticCellSize);
+    int32_t lastY = (int32_t)std::floor((mHeight + mStaticMaxExtent) / mStaticCellSize);
+    for (int32_t y = firstY; y <= lastY; y++)
+    {
+        for (int32_t x = firstX; x <= lastX; x++)
+        {
+            mRenderStats.staticCellsVisited++;
+            auto found = mStaticCells.find(((uint64_t)(uint32_t)x << 32) | (uint32_t)y);
+            if (found != mStaticCells.end())
+            {
+                mStaticCandidates.insert(mStaticCandidates.end(), found->second.begin(), found->second.end());
+            }
+        }
+    }
+    mStaticCandidates.insert(mStaticCandidates.end(), mStaticOversized.begin(), mStaticOversized.end());
+    mRenderStats.staticCandidates = static_cast<uint32_t>(mStaticCandidates.size());
+}
+
+void KEngineVulkan::SpriteRenderer::GatherTransforms() const
+{
+    //One pass of virtual calls into flat arrays for dynamic graphics, everything after this works on the arrays.
+    //Only plain transforms are composed here, the rest and all statics keep GetAsMatrix as their matrix
+    GatherStatics();
+    size_t dynamicCount = mRenderList.size();
+    size_t count = dynamicCount + mStaticCandidates.size();
+    mFrameEntries.assign(mRenderList.begin(), mRenderList.end());
+    mTranslationX.resize(count);
+    mTranslationY.resize(count);
+    mRotation.resize(dynamicCount);
+    mScale.resize(dynamicCount);
+    mLinear00.resize(count);
+    mLinear01.resize(count);
+    mLinear10.resize(count);
+    mLinear11.resize(count);
+    mExactSlots.resize(count);
+    mExactMatrices.clear();
+    mSpriteWidth.resize(count);
+    mSpriteHeight.resize(count);
+    for (size_t i = 0; i < dynamicCount; i++)
+    {
+        const SpriteGraphic* graphic = mRenderList[i].graphic;
+        const KEngine2D::Transform* transform = graphic->GetTransform();
+        if (graphic->HasPlainTransform())
+        {
+            const auto& translation = transform->GetTranslation();
+            mTranslationX[i] = (float)translation.x;
+            mTranslationY[i] = (float)translation.y;
+            mRotation[i] = (float)transform->GetRotation();
+            mScale[i] = (float)transform->GetScale();
+            mExactSlots[i] = NO_EXACT_MATRIX;
+        }
+        else
+        {
+            mRotation[i] = 0.0f;
+            mScale[i] = 0.0f;
+            mExactSlots[i] = static_cast<uint32_t>(mExactMatrices.size());
+            mExactMatrices.push_back(transform->GetAsMatrix());
+        }
+        mSpriteWidth[i] = (float)graphic->GetSprite()->width;
+        mSpriteHeight[i] = (float)graphic->GetSprite()->height;
+    }
+    PlainLinearParts(mRotation.data(), mScale.data(), dynamicCount, mLinear00.data(), mLinear01.data(), mLinear10.data(), mLinear11.data());
+
+    //Static candidates already carry their matrix
+    for (size_t i = dynamicCount; i < count; i++)
+    {
+        const StaticEntry& staticEntry = mStaticList[mStaticCandidates[i - dynamicCount]];
+        mFrameEntries.push_back(staticEntry.entry);
+        mExactSlots[i] = static_cast<uint32_t>(mExactMatrices.size());
+        mExactMatrices.push_back(staticEntry.matrix);
+        mSpriteWidth[i] = staticEntry.width;
+        mSpriteHeight[i] = staticEntry.height;
+    }
+
+    //Culling reads the linear part and translation of every entry, so fill them in from the exact matrices too
+    for (size_t i = 0; i < count; i++)
+    {
+        if (mExactSlots[i] == NO_EXACT_MATRIX)
+        {
+            continue;
+        }
+        const KEngine2D::Matrix& matrix = mExactMatrices[mExactSlots[i]];
+        mTranslationX[i] = (float)matrix.data[3][0];
+        mTranslationY[i] = (float)matrix.data[3][1];
+        mLinear00[i] = (float)matrix.data[0][0];
+        mLinear01[i] = (float)matrix.data[0][1];
+        mLinear10[i] = (float)matrix.data[1][0];
+        mLinear11[i] = (float)matrix.data[1][1];
+    }
+}
+
+void KEngineVulkan::SpriteRenderer::CullRenderList() const
+{
+    size_t count = mFrameEntries.size();
+    mVisible.resize(count);
+    if (!mCullingEnabled)
+    {
+        std::fill(mVisible.begin(), mVisible.end(), (uint8_t)1);
+        mRenderStats.spritesVisible = static_cast<uint32_t>(count);
+        return;
+    }
+
+    //The sprite rectangle is taken either side of the origin, which covers centered and corner-anchored geometry alike
+    size_t visibleCount = CullBounds(mTranslationX.data(), mTranslationY.data(), mLinear00.data(), mLinear01.data(), mLinear10.data(), mLinear11.data(),
+        mSpriteWidth.data(), mSpriteHeight.data(), count, (float)mWidth, (float)mHeight, mVisible.data());
+    mRenderStats.spritesVisible = static_cast<uint32_t>(visibleCount);
+    mRenderStats.spritesCulled = static_cast<uint32_t>(count - visibleCount);
+}
+
+void KEngineVulkan::SpriteRenderer::WriteModelMatrices(KEngine2D::Matrix* matrices) const
+{
+    ComposeModelMatrices(mTranslationX.data(), mTranslationY.data(), mLinear00.data(), mLinear01.data(), mLinear10.data(), mLinear11.data(),
+        mDrawIndices.data(), mDrawIndices.size(), matrices);
+    if (!mExactMatrices.empty())
+    {
+        for (size_t k = 0; k < mDrawIndices.size(); k++)
+        {
+            uint32_t slot = mExactSlots[mDrawIndices[k]];
+            if (slot != NO_EXACT_MATRIX)
+            {
+                matrices[k] = mExactMatrices[slot];
+            }
+        }
+    }
+
+#ifndef NDEBUG
+    //A graphic marked plain must compose to its transform's own matrix
+    for (size_t k = 0; k < mDrawIndices.size(); k++)
+    {
+        if (mExactSlots[mDrawIndices[k]] != NO_EXACT_MATRIX)
+        {
+            continue;
+        }
+        KEngine2D::Matrix expected = mFrameEntries[mDrawIndices[k]].graphic->GetTransform()->GetAsMatrix();
+        for (int column = 0; column < 4; column++)
+        {
+            for (int row = 0; row < 4; row++)
+            {
+                assert(std::abs(matrices[k].data[column][row] - expected.data[column][row]) <= 1e-3f * std::max(1.0f, std::abs((float)expected.data[column][row])));
+            }
+        }
+    }
+#endif
+}
+
+void KEngineVulkan::SpriteRenderer::SortRenderList() const
+{
+    mSortEntries.clear();
+    mPipelineIds.clear();
+    mTextureIds.clear();
+    mGeometryIds.clear();
+
+    for (size_t i = 0; i < mFrameEntries.size(); i++)
+    {
+        if (!mVisible[i])
+        {
+            continue;
+        }
+        const RenderEntry& entry = mFrameEntries[i];
+        SpriteGraphic* graphic = entry.graphic;
+        const Sprite* sprite = graphic->GetSprite();
+        uint64_t key = (uint64_t)graphic->GetLayer() << 56;
+        if (mTransparentLayers.test(graphic->GetLayer()))
+        {
+            //Swap-and-pop removal reorders the dense list, so add order comes from the sequence number
+            key |= entry.sequence & 0x00FFFFFFFFFFFFFF;
+        }
+        else
+        {
+            //Pipeline 16 bits, texture 20 bits, geometry 20 bits; overflowing ids share the last slot, which only costs binds
+            key |= StateId(mPipelineIds, (uint64_t)sprite->GetPipeline(), 0xFFFF) << 40;
+            key |= StateId(mTextureIds, (uint64_t)sprite->GetTextureView(), 0xFFFFF) << 20;
+            key |= StateId(mGeometryIds, (uint64_t)sprite->vertexBuffer.first, 0xFFFFF);
+        }
+        mSortEntries.push_back({ key, graphic, static_cast<uint32_t>(i) });
+    }
+
+    if (mSortEntries.size() > 1)
+    {
+        RadixSort(mSortEntries, mSortScratch);
+    }
+}
+
+void KEngineVulkan::SpriteRenderer::BuildBatches() const
+{
+    //Consecutive sorted graphics with the same state merge into one instanced batch, anything else draws alone
+    for (Batch& batch : mBatches)
+    {
+        batch.graphics.clear();
+    }
+    size_t batchCount = 0;
+    mDrawIndices.resize(mSortEntries.size());
+    mWriteInstanceUvs = false;
+
+    for (size_t position = 0; position < mSortEntries.size(); position++)
+    {
+        const SortEntry& entry = mSortEntries[position];
+        mDrawIndices[position] = entry.index;
+        const Sprite* sprite = entry.graphic->GetSprite();
+        BatchKey key{ sprite->GetPipeline(), sprite->GetTextureView(), sprite->vertexBuffer.first, sprite->indexBuffer.first, sprite->indexCount };
+        bool instanced = sprite->mLayout->hasInstanceBinding();
+        if (batchCount == 0 || !instanced || !(mBatches[batchCount - 1].key == key) || !mBatches[batchCount - 1].sprite->mLayout->hasInstanceBinding())
+        {
+            if (batchCount == mBatches.size())
+            {
+                mBatches.emplace_back();
+            }
+            mBatches[batchCount].sprite = sprite;
+            mBatches[batchCount].key = key;
+            mBatches[batchCount].firstInstance = position;
+            batchCount++;
+            mWriteInstanceUvs = mWriteInstanceUvs || (instanced && sprite->mLayout->hasInstanceUvBinding());
+        }
+        mBatches[batchCount - 1].graphics.push_back(entry.graphic);
+    }
+    mBatches.resize(batchCount);
+}
+
+KEngine2D::Matrix* KEngineVulkan::SpriteRenderer::ReserveInstances(int currentFrame, size_t instanceCount) const
+{
+    if (mInstanceBuffers.empty())
+    {
+        int maxFramesInFlight = mCore->getMaxFramesInFlight();
+        mInstanceBuffers.resize(maxFramesInFlight, { VK_NULL_HANDLE, VK_NULL_HANDLE });
+        mInstanceData.resize(maxFramesInFlight, nullptr);
+        mInstanceUvData.resize(maxFramesInFlight, nullptr);
+        mInstanceCapacities.resize(maxFramesInFlight, 0);
+    }
+
+    //startFrame has waited on this frame's fence, so its buffer is free to replace
+    if (instanceCount > mInstanceCapacities[currentFrame])
+    {
+        auto& bufferPair = mInstanceBuffers[currentFrame];
+        if (bufferPair.first != VK_NULL_HANDLE)
+        {
+            vmaDestroyBuffer(mCore->getAllocator(), bufferPair.first, bufferPair.second);
+        }
+        size_t capacity = std::max<size_t>(1024, mInstanceCapacities[currentFrame] * 2);
+        while (capacity < instanceCount)
+        {
+            capacity *= 2;
+        }
+        //Model matrices first, then one UV transform per instance
+        mCore->createBuffer(capacity * (sizeof(KEngine2D::Matrix) + 4 * sizeof(float)), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, (VmaAllocationCreateFlagBits)(VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT), bufferPair.first, bufferPair.second);
+        VmaAllocationInfo allocationInfo;
+        vmaGetAllocationInfo(mCore->getAllocator(), bufferPair.second, &allocationInfo);
+        mInstanceData[currentFrame] = static_cast<KEngine2D::Matrix*>(allocationInfo.pMappedData);
+        mInstanceUvData[currentFrame] = reinterpret_cast<float*>(mInstanceData[currentFrame] + capacity);
+        mInstanceCapacities[currentFrame] = capacity;
+    }
+    return mInstanceData[currentFrame];
+}
+
+bool KEngineVulkan::SpriteRenderer::BatchKey::operator==(const BatchKey& other) const
+{
+    return pipeline == other.pipeline && texture == other.texture && vertexBuffer == other.vertexBuffer && indexBuffer == other.indexBuffer && indexCount == other.indexCount;
+}
+
 void KEngineVulkan::SpriteRenderer::AddToRenderList(SpriteGraphic* spriteGraphic)
 {
     assert(mInitialized);
-    mRenderList.push_back(spriteGraphic);
+    assert(!IsInRenderList(spriteGraphic->mRenderHandle));
+    uint32_t slot;
+    if (!mFreeRenderSlots.empty())
+    {
+        slot = mFreeRenderSlots.back();
+        mFreeRenderSlots.pop_back();
+    }
+    else
+    {
+        slot = static_cast<uint32_t>(mRenderSlots.size());
+        mRenderSlots.push_back({ 0, 1, false }); // Generation 0 is never live, so a default handle is always stale
+    }
+    mRenderSlots[slot].dense = static_cast<uint32_t>(mRenderList.size());
+    mRenderSlots[slot].isStatic = false;
+    mRenderList.push_back({ spriteGraphic, slot, mNextRenderSequence++ });
+    spriteGraphic->mRenderHandle = { slot, mRenderSlots[slot].generation };
 }
 
 void KEngineVulkan::SpriteRenderer::RemoveFromRenderList(SpriteGraphic* spriteGraphic)
 {
     assert(mInitialized);
-    mRenderList.remove(spriteGraphic);
+    RenderHandle handle = spriteGraphic->mRenderHandle;
+    if (!IsInRenderList(handle))
+    {
+        assert(false); // Not in this render list
+        return;
+    }
+    RenderSlot& slot = mRenderSlots[handle.index];
+    uint32_t dense = slot.dense;
+
+    //Swap-and-pop, then repoint the slot of the entry that moved
+    if (slot.isStatic)
+    {
+        RemoveStaticFromCell(dense);
+        mStaticList[dense] = mStaticList.back();
+        mStaticList.pop_back();
+        if (dense < mStaticList.size())
+        {
+            StaticEntry& moved = mStaticList[dense];
+            mRenderSlots[moved.entry.slot].dense = dense;
+            StaticBucket(moved)[moved.cellPosition] = dense;
+        }
+    }
+    else
+    {
+        mRenderList[dense] = mRenderList.back();
+        mRenderSlots[mRenderList[dense].slot].dense = dense;
+        mRenderList.pop_back();
+    }
+
+    if (++slot.generation == 0)
+    {
+        slot.generation = 1;
+    }
+    mFreeRenderSlots.push_back(handle.index);
+    spriteGraphic->mRenderHandle = RenderHandle();
+}
+
+bool KEngineVulkan::SpriteRenderer::IsInRenderList(RenderHandle handle) const
+{
+    return handle.index < mRenderSlots.size() && handle.generation != 0 && mRenderSlots[handle.index].generation == handle.generation;
+}
+
+size_t KEngineVulkan::SpriteRenderer::GetRenderListSize() const
+{
+    return mRenderList.size() + mStaticList.size();
+}
+
+void KEngineVulkan::SpriteRenderer::SetStatic(SpriteGraphic* graphic, bool isStatic)
+{
+    assert(IsInRenderList(graphic->mRenderHandle));
+    RenderSlot& slot = mRenderSlots[graphic->mRenderHandle.index];
+    if (slot.isStatic == isStatic)
+    {
+        return;
+    }
+
+    //Move the entry between the dense lists, keeping its slot, handle and add sequence
+    uint32_t dense = slot.dense;
+    if (isStatic)
+    {
+        StaticEntry staticEntry{};
+        staticEntry.entry = mRenderList[dense];
+        mRenderList[dense] = mRenderList.back();
+        mRenderSlots[mRenderList[dense].slot].dense = dense;
+        mRenderList.pop_back();
+
+        ReadStaticTransform(staticEntry);
+        slot.isStatic = true;
+        slot.dense = static_cast<uint32_t>(mStaticList.size());
+        mStaticList.push_back(staticEntry);
+        InsertStatic(slot.dense);
+    }
+    else
+    {
+        RemoveStaticFromCell(dense);
+        RenderEntry entry = mStaticList[dense].entry;
+        mStaticList[dense] = mStaticList.back();
+        mStaticList.pop_back();
+        if (dense < mStaticList.size())
+        {
+            StaticEntry& moved = mStaticList[dense];
+            mRenderSlots[moved.entry.slot].dense = dense;
+            StaticBucket(moved)[moved.cellPosition] = dense;
+        }
+
+        slot.isStatic = false;
+        slot.dense = static_cast<uint32_t>(mRenderList.size());
+        mRenderList.push_back(entry);
+    }
+}
+
+bool KEngineVulkan::SpriteRenderer::IsStatic(const SpriteGraphic* graphic) const
+{
+    return IsInRenderList(graphic->mRenderHandle) && mRenderSlots[graphic->mRenderHandle.index].isStatic;
+}
+
+void KEngineVulkan::SpriteRenderer::UpdateStatic(SpriteGraphic* graphic)
+{
+    assert(IsStatic(graphic));
+    uint32_t staticIndex = mRenderSlots[graphic->mRenderHandle.index].dense;
+    StaticEntry& staticEntry = mStaticList[staticIndex];
+    uint64_t oldCell = staticEntry.cell;
+    float oldExtent = staticEntry.halfExtent;
+    ReadStaticTransform(staticEntry);
+    float extent = MaxHalfExtent(staticEntry);
+    //Within the same cell only the cached transform and the grid's looseness change
+    if (staticEntry.oversized || extent > mStaticCellSize || StaticCellKey(staticEntry.translationX, staticEntry.translationY) != oldCell)
+    {
+        RemoveStaticFromCell(staticIndex);
+        InsertStatic(staticIndex);
+    }
+    else
+    {
+        staticEntry.halfExtent = extent;
+        if (extent >= mStaticMaxExtent)
+        {
+            mStaticMaxExtent = extent;
+        }
+        else if (oldExtent >= mStaticMaxExtent)
+        {
+            mStaticMaxExtentStale = true;
+        }
+    }
+}
+
+void KEngineVulkan::SpriteRenderer::SetStaticCellSize(float cellSize)
+{
+    assert(cellSize > 0.0f);
+    mStaticCellSize = cellSize;
+    mStaticCells.clear();
+    mStaticOversized.clear();
+    mStaticMaxExtent = 0.0f;
+    mStaticMaxExtentStale = false;
+    for (uint32_t i = 0; i < mStaticList.size(); i++)
+    {
+        InsertStatic(i);
+    }
+}
+
+void KEngineVulkan::SpriteRenderer::ReadStaticTransform(StaticEntry& staticEntry)
+{
+    const SpriteGraphic* graphic = staticEntry.entry.graphic;
+    staticEntry.matrix = graphic->GetTransform()->GetAsMatrix();
+    staticEntry.translationX = (float)staticEntry.matrix.data[3][0];
+    staticEntry.translationY = (float)staticEntry.matrix.data[3][1];
+    staticEntry.width = (float)graphic->GetSprite()->width;
+    staticEntry.height = (float)graphic->GetSprite()->height;
+}
+
+uint64_t KEngineVulkan::SpriteRenderer::StaticCellKey(float x, float y) const
+{
+    int32_t cellX = (int32_t)std::floor(x / mStaticCellSize);
+    int32_t cellY = (int32_t)std::floor(y / mStaticCellSize);
+    return ((uint64_t)(uint32_t)cellX << 32) | (uint32_t)cellY;
+}
+
+void KEngineVulkan::SpriteRenderer::InsertStatic(uint32_t staticIndex)
+{
+    //Loose grid: each graphic sits in the cell of its center only, and queries grow the view by the largest extent instead.
+    //Anything wider than a cell would loosen every query, so it goes in the oversized list instead
+    StaticEntry& staticEntry = mStaticList[staticIndex];
+    staticEntry.halfExtent = MaxHalfExtent(staticEntry);
+    staticEntry.oversized = staticEntry.halfExtent > mStaticCellSize;
+    staticEntry.cell = staticEntry.oversized ? 0 : StaticCellKey(staticEntry.translationX, staticEntry.translationY);
+    std::vector<uint32_t>& bucket = StaticBucket(staticEntry);
+    staticEntry.cellPosition = static_cast<uint32_t>(bucket.size());
+    bucket.push_back(staticIndex);
+    if (!staticEntry.oversized)
+    {
+        mStaticMaxExtent = std::max(mStaticMaxExtent, staticEntry.halfExtent);
+    }
+}
+
+std::vector<uint32_t>& KEngineVulkan::SpriteRenderer::StaticBucket(const StaticEntry& staticEntry)
+{
+    return staticEntry.oversized ? mStaticOversized : mStaticCells[staticEntry.cell];
+}
+
+float KEngineVulkan::SpriteRenderer::MaxHalfExtent(const StaticEntry& staticEntry)
+{
+    const KEngine2D::Matrix& matrix = staticEntry.matrix;
+    float extentX = (float)(std::abs(matrix.data[0][0]) * staticEntry.width + std::abs(matrix.data[1][0]) * staticEntry.height);
+    float extentY = (float)(std::abs(matrix.data[0][1]) * staticEntry.width + std::abs(matrix.data[1][1]) * staticEntry.height);
+    return std::max(extentX, extentY);
+}
+
+void KEngineVulkan::SpriteRenderer::RemoveStaticFromCell(uint32_t staticIndex)
+{
+    StaticEntry& staticEntry = mStaticList[staticIndex];
+    if (staticEntry.oversized)
+    {
+        mStaticOversized[staticEntry.cellPosition] = mStaticOversized.back();
+        mStaticList[mStaticOversized[staticEntry.cellPosition]].cellPosition = staticEntry.cellPosition;
+        mStaticOversized.pop_back();
+        return;
+    }
+
+    auto found = mStaticCells.find(staticEntry.cell);
+    assert(found != mStaticCells.end());
+    std::vector<uint32_t>& cell = found->second;
+    cell[staticEntry.cellPosition] = cell.back();
+    mStaticList[cell[staticEntry.cellPosition]].cellPosition = staticEntry.cellPosition;
+    cell.pop_back();
+    if (cell.empty())
+    {
+        mStaticCells.erase(found);
+    }
+    //The grid only tightens once the largest entry is gone
+    if (staticEntry.halfExtent >= mStaticMaxExtent)
+    {
+        mStaticMaxExtentStale = true;
+    }
 }
 
 int KEngineVulkan::SpriteRenderer::GetWidth() const {
@@ -271,4 +1470,160 @@ int KEngineVulkan::SpriteRenderer::GetHeight() const {
 
 KEngineVulkan::VulkanCore* KEngineVulkan::SpriteRenderer::GetCore() const {
     return mCore;
-}
\ No newline at end of file
+}
+
+void KEngineVulkan::SpriteRenderer::SetLayerTransparent(uint8_t layer, bool transparent)
+{
+    mTransparentLayers.set(layer, transparent);
+}
+
+bool KEngineVulkan::SpriteRenderer::IsLayerTransparent(uint8_t layer) const
+{
+    return mTransparentLayers.test(layer);
+}
+
+void KEngineVulkan::SpriteRenderer::SetCullingEnabled(bool enabled)
+{
+    mCullingEnabled = enabled;
+}
+
+void KEngineVulkan::SpriteRenderer::SetScissor(const VkRect2D& scissor)
+{
+    mScissor = scissor;
+}
+
+void KEngineVulkan::SpriteRenderer::ClearScissor()
+{
+    mScissor.reset();
+}
+
+bool KEngineVulkan::SpriteRenderer::IsCullingEnabled() const
+{
+    return mCullingEnabled;
+}
+
+KEngineVulkan::SpriteRenderer::RenderStats& KEngineVulkan::SpriteRenderer::RenderStats::operator+=(const RenderStats& other)
+{
+    drawCalls += other.drawCalls;
+    pipelineBinds += other.pipelineBinds;
+    pipelineBindsSkipped += other.pipelineBindsSkipped;
+    vertexBufferBinds += other.vertexBufferBinds;
+    vertexBufferBindsSkipped += other.vertexBufferBindsSkipped;
+    indexBufferBinds += other.indexBufferBinds;
+    indexBufferBindsSkipped += other.indexBufferBindsSkipped;
+    descriptorSetBinds += other.descriptorSetBinds;
+    descriptorSetBindsSkipped += other.descriptorSetBindsSkipped;
+    spritesVisible += other.spritesVisible;
+    spritesCulled += other.spritesCulled;
+    staticCellsVisited += other.staticCellsVisited;
+    staticCandidates += other.staticCandidates;
+    return *this;
+}
+
+const KEngineVulkan::SpriteRenderer::RenderStats& KEngineVulkan::SpriteRenderer::GetRenderStats() const
+{
+    return mRenderStats;
+}
+
+namespace
+{
+    //Translation, rotation and scale with nothing above it, what SetPlainTransform promises
+    class BenchmarkTransform : public KEngine2D::Transform
+    {
+    public:
+        BenchmarkTransform(double x, double y, double rotation, double scale)
+        {
+            mTranslation.x = x;
+            mTranslation.y = y;
+            mRotation = rotation;
+            mScale = scale;
+        }
+        const KEngine2D::Point& GetTranslation() const override { return mTranslation; }
+        double GetRotation() const override { return mRotation; }
+        double GetScale() const override { return mScale; }
+        KEngine2D::Matrix GetAsMatrix() const override
+        {
+            double c = std::cos(mRotation) * mScale;
+            double s = std::sin(mRotation) * mScale;
+            KEngine2D::Matrix matrix;
+            const float data[16] = {
+                (float)c, (float)s, 0.0f, 0.0f,
+                (float)-s, (float)c, 0.0f, 0.0f,
+                0.0f, 0.0f, 1.0f, 0.0f,
+                (float)mTranslation.x, (float)mTranslation.y, 0.0f, 1.0f
+            };
+            memcpy(&matrix, data, sizeof(data));
+            return matrix;
+        }
+
+    private:
+        KEngine2D::Point mTranslation;
+        double mRotation;
+        double mScale;
+    };
+}
+
+KEngineVulkan::TransformBenchmark KEngineVulkan::BenchmarkModelMatrices(const std::vector<const KEngine2D::Transform*>& transforms, int iterations)
+{
+    //Both paths pay the virtual calls Render would, the batched one for the getters it gathers plain transforms through
+    size_t spriteCount = transforms.size();
+    std::mt19937 random(42);
+    std::vector<uint32_t> order(spriteCount);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), random);
+    std::vector<KEngine2D::Matrix> output(spriteCount);
+
+    auto perObjectStart = std::chrono::steady_clock::now();
+    for (int iteration = 0; iteration < iterations; iteration++)
+    {
+        for (size_t k = 0; k < spriteCount; k++)
+        {
+            output[k] = transforms[order[k]]->GetAsMatrix();
+        }
+    }
+    double perObjectSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - perObjectStart).count();
+
+    std::vector<float> translationX(spriteCount), translationY(spriteCount), rotation(spriteCount), scale(spriteCount);
+    std::vector<float> linear00(spriteCount), linear01(spriteCount), linear10(spriteCount), linear11(spriteCount);
+    auto batchedStart = std::chrono::steady_clock::now();
+    for (int iteration = 0; iteration < iterations; iteration++)
+    {
+        for (size_t i = 0; i < spriteCount; i++)
+        {
+            const auto& translation = transforms[i]->GetTranslation();
+            translationX[i] = (float)translation.x;
+            translationY[i] = (float)translation.y;
+            rotation[i] = (float)transforms[i]->GetRotation();
+            scale[i] = (float)transforms[i]->GetScale();
+        }
+        PlainLinearParts(rotation.data(), scale.data(), spriteCount, linear00.data(), linear01.data(), linear10.data(), linear11.data());
+        ComposeModelMatrices(translationX.data(), translationY.data(), linear00.data(), linear01.data(), linear10.data(), linear11.data(), order.data(), spriteCount, output.data());
+    }
+    double batchedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - batchedStart).count();
+
+    return { spriteCount, perObjectSeconds / iterations, batchedSeconds / iterations };
+}
+
+std::vector<KEngineVulkan::TransformBenchmark> KEngineVulkan::BenchmarkModelMatrices(int iterations)
+{
+    std::mt19937 random(42);
+    std::uniform_real_distribution<double> position(0.0, 4096.0);
+    std::uniform_real_distribution<double> angle(-6.283185307179586, 6.283185307179586);
+    std::uniform_real_distribution<double> scale(0.5, 2.0);
+
+    std::vector<TransformBenchmark> results;
+    for (size_t spriteCount : { (size_t)1000, (size_t)10000, (size_t)100000 })
+    {
+        std::vector<BenchmarkTransform> objects;
+        std::vector<const KEngine2D::Transform*> transforms;
+        objects.reserve(spriteCount);
+        transforms.reserve(spriteCount);
+        for (size_t i = 0; i < spriteCount; i++)
+        {
+            objects.emplace_back(position(random), position(random), angle(random), scale(random));
+            transforms.push_back(&objects.back());
+        }
+        results.push_back(BenchmarkModelMatrices(transforms, iterations));
+    }
+    return results;
+}
@@ -12,9 +12,14 @@
 #include "Transform2D.h"
 #include "Renderer2D.h"
 #include "ShaderFactory.h"
+#include "TextureFactory.h"
 #include <vulkan/vulkan.h>
 #include "vk_mem_alloc.h"
-#include <list>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+#include <bitset>
+#include <optional>
 
 
 namespace KEngineVulkan
@@ -34,10 +39,30 @@ namespace KEngineVulkan
 
         VkImageView textureImageView{ VK_NULL_HANDLE }; // Owned by TextureFactory
         VkSampler   textureSampler{ VK_NULL_HANDLE }; // Owned by VulkanCore
+
+        //Streamed textures: with a factory set the view is looked up through the handle, replacing textureImageView,
+        //so graphics move from the placeholder to the real image when it lands
+        const TextureFactory* textureFactory{ nullptr };
+        TextureHandle texture;
+        VkImageView GetTextureView() const;
+        uint64_t GetTextureVersion() const; // Changes with the view, so a descriptor can't be fooled by a recycled handle value
+
+        //Lazy pipelines: with a factory set the pipeline comes from the handle instead of graphicsPipeline, the layout's fallback
+        //until the permutation has compiled. mLayout has to be the layout the handle's key names.
+        const ShaderFactory* shaderFactory{ nullptr };
+        PipelineHandle pipeline;
+        VkPipeline GetPipeline() const;
     };
 
     class SpriteRenderer;
 
+    //Names a slot in the renderer's render list, a stale handle fails the generation check
+    struct RenderHandle
+    {
+        uint32_t index{ 0 };
+        uint32_t generation{ 0 };
+    };
+
     class SpriteGraphic
     {
     public:
@@ -46,23 +71,74 @@ namespace KEngineVulkan
         void Init(SpriteRenderer* renderer, Sprite const* sprite, KEngine2D::Transform const* transform);
         void Deinit();
         void createDescriptorSets(KEngineVulkan::VulkanCore* core, const KEngineVulkan::Sprite* sprite);
-        void updateUniformBuffer(int currentFrame, const KEngine2D::Matrix & projectionMatrix);
+        void refreshTexture(KEngineVulkan::VulkanCore* core, int currentFrame); // Rewrites this frame's sampler if the sprite's view changed
+        void refreshUniformBuffer(KEngineVulkan::VulkanCore* core, int currentFrame); // Rewrites this frame's uniform binding if the arena grew
+        uint32_t updateUniformBuffer(const KEngine2D::Matrix & modelMatrix, const KEngine2D::Matrix & projectionMatrix); // Returns the dynamic offset for this frame
         Sprite const* GetSprite() const;
         void SetSprite(Sprite const* sprite);
         KEngine2D::Transform const* GetTransform() const;
         VkDescriptorSet GetDescriptorSet(int currentFrame) const;
+        void SetLayer(uint8_t layer); // Lower layers draw first
+        uint8_t GetLayer() const;
+        //The transform is only its own translation, rotation and uniform scale, with no parent or override of GetAsMatrix,
+        //so Render can compose its matrix in the batched pass. Off by default, which takes GetAsMatrix as it is
+        void SetPlainTransform(bool plain);
+        bool HasPlainTransform() const;
+        //Part of the texture to draw, the whole of it by default. Layouts with a UV stream or UV push constant receive it
+        //as an offset and scale, so sprites from one atlas page can share a quad and batch
+        void SetUVRect(float u0, float v0, float u1, float v1);
+        void SetUVRect(const TextureFactory::AtlasRegion& region);
+        const float* GetUVTransform() const; // Offset in [0] and [1], scale in [2] and [3]
+        RenderHandle GetRenderHandle() const;
 
     protected:
+        friend class SpriteRenderer;
         Sprite const* mSprite;
         KEngine2D::Transform const* mTransform;
         SpriteRenderer* mRenderer;
+        uint8_t mLayer;
+        bool mPlainTransform;
+        float mUvTransform[4];
+        RenderHandle mRenderHandle;
         std::vector<VkDescriptorSet> descriptorSets;
-        std::vector<std::pair<VkBuffer, VmaAllocation>> uniformBuffers;
+        std::vector<VkImageView> writtenTextures; // Per frame in flight, what each set's sampler binding points at
+        std::vector<uint64_t> writtenTextureVersions;
+        std::vector<uint64_t> writtenUniformGenerations; // Per frame in flight, the frame uniform arena each set's buffer binding points at
+        void writeTextureDescriptor(KEngineVulkan::VulkanCore* core, int frame, VkImageView view);
+        void writeUniformDescriptor(KEngineVulkan::VulkanCore* core, int frame);
     };
 
     class SpriteRenderer : public KEngine2D::Renderer
     {
     public:
+        //Contents of set 0 for layouts created with perViewSet, written once per Render
+        struct ViewUniforms
+        {
+            KEngine2D::Matrix projection;
+            float viewport[4];  // x, y, width, height
+            float time;         // Seconds since Init
+            float padding[3];
+        };
+
+        //Bind counts for the last Render, a skipped bind matched the state left by the previous draw
+        struct RenderStats
+        {
+            uint32_t drawCalls;
+            uint32_t pipelineBinds;
+            uint32_t pipelineBindsSkipped;
+            uint32_t vertexBufferBinds;
+            uint32_t vertexBufferBindsSkipped;
+            uint32_t indexBufferBinds;
+            uint32_t indexBufferBindsSkipped;
+            uint32_t descriptorSetBinds;
+            uint32_t descriptorSetBindsSkipped;
+            uint32_t spritesVisible;
+            uint32_t spritesCulled;
+            uint32_t staticCellsVisited;
+            uint32_t staticCandidates;      // Static graphics in the visited cells, the only static ones tested
+            RenderStats& operator+=(const RenderStats& other);
+        };
+
         SpriteRenderer();
         ~SpriteRenderer();
         void Init(VulkanCore * core, int width, int height);
@@ -70,17 +146,176 @@ namespace KEngineVulkan
         void Render() const;
         void AddToRenderList(SpriteGraphic* cursesGraphic);
         void RemoveFromRenderList(SpriteGraphic* cursesGraphic);
+        bool IsInRenderList(RenderHandle handle) const;
+        size_t GetRenderListSize() const;
+
+        //Static graphics live in a loose uniform grid keyed on their bounds, so Render only visits cells overlapping the view.
+        //Ones whose half extent is over the cell size are kept out of the grid in a list tested every frame.
+        //Their transform is read when they are marked static and again on UpdateStatic, not every frame.
+        void SetStatic(SpriteGraphic* graphic, bool isStatic);
+        bool IsStatic(const SpriteGraphic* graphic) const;
+        void UpdateStatic(SpriteGraphic* graphic); // After moving a static graphic, re-reads its transform and moves it between cells
+        void SetStaticCellSize(float cellSize);    // Rebuilds the grid, 256 by default
         int GetWidth() const;
         int GetHeight() const;
         VulkanCore * GetCore() const;
+        void SetLayerTransparent(uint8_t layer, bool transparent); // Transparent layers draw in list order rather than state order
+        bool IsLayerTransparent(uint8_t layer) const;
+        void SetCullingEnabled(bool enabled); // Skip graphics whose bounds fall outside the view, on by default
+        bool IsCullingEnabled() const;
+        void SetScissor(const VkRect2D& scissor); // Clips everything this renderer draws, in framebuffer pixels, e.g. a UI panel
+        void ClearScissor();
+        const RenderStats& GetRenderStats() const;
     protected:
+        //Graphics sharing pipeline, texture and geometry, drawn with one instanced call when the layout has an instance binding.
+        //Atlas sprites drawn through a UV stream only need a shared quad, their UV rects travel per instance
+        struct BatchKey
+        {
+            VkPipeline pipeline;
+            VkImageView texture;
+            VkBuffer vertexBuffer;
+            VkBuffer indexBuffer;
+            int indexCount;
+            bool operator==(const BatchKey& other) const;
+        };
+        struct Batch
+        {
+            const Sprite* sprite;
+            BatchKey key;
+            size_t firstInstance; // Position of the first graphic in draw order, which is also its model matrix slot
+            std::vector<SpriteGraphic*> graphics;
+        };
+        //Layer in the top byte, then pipeline, texture and geometry ids; transparent layers use the add sequence instead
+        struct SortEntry
+        {
+            uint64_t key;
+            SpriteGraphic* graphic;
+            uint32_t index; // Into mFrameEntries and the transform arrays
+        };
+        //Dense render list entry, the sequence number keeps transparent layers in the order graphics were added
+        struct RenderEntry
+        {
+            SpriteGraphic* graphic;
+            uint32_t slot;
+            uint64_t sequence;
+        };
+        struct RenderSlot
+        {
+            uint32_t dense;
+            uint32_t generation;
+            bool isStatic; // dense indexes mStaticList rather than mRenderList
+        };
+        //Static graphics keep their transform in SoA-ready form along with their grid cell and place in it
+        struct StaticEntry
+        {
+            RenderEntry entry;
+            KEngine2D::Matrix matrix; // GetAsMatrix when last read
+            float translationX;
+            float translationY;
+            float width;
+            float height;
+            float halfExtent;     // MaxHalfExtent when last inserted
+            bool oversized;       // In mStaticOversized rather than a grid cell
+            uint64_t cell;
+            uint32_t cellPosition;
+        };
+        //What a command buffer has bound so far this Render, one per recording thread
+        struct RecordState
+        {
+            VkPipeline pipeline{ VK_NULL_HANDLE };
+            VkBuffer vertexBuffer{ VK_NULL_HANDLE };
+            VkBuffer indexBuffer{ VK_NULL_HANDLE };
+            //What each set slot holds and the layout it was bound with, slot 0 is the view set or a view-less object set
+            VkDescriptorSet sets[2]{ VK_NULL_HANDLE, VK_NULL_HANDLE };
+            VkPipelineLayout setLayouts[2]{ VK_NULL_HANDLE, VK_NULL_HANDLE };
+            RenderStats stats{};
+            void BindSet(VkCommandBuffer commandBuffer, VkPipelineLayout layout, uint32_t slot, VkDescriptorSet set, uint32_t dynamicOffsetCount, const uint32_t* dynamicOffsets);
+        };
+
+        static void RadixSort(std::vector<SortEntry>& entries, std::vector<SortEntry>& scratch);
+        void ReadStaticTransform(StaticEntry& entry);
+        uint64_t StaticCellKey(float x, float y) const;
+        static float MaxHalfExtent(const StaticEntry& staticEntry); // Of the world box, matching CullBounds
+        void InsertStatic(uint32_t staticIndex);
+        void RemoveStaticFromCell(uint32_t staticIndex);
+        std::vector<uint32_t>& StaticBucket(const StaticEntry& staticEntry); // The cell or oversized list holding it
+        void GatherStatics() const;
+        void GatherTransforms() const;
+        void CullRenderList() const;
+        void SortRenderList() const;
+        void BuildBatches() const;
+        void WriteModelMatrices(KEngine2D::Matrix* matrices) const;
+        KEngine2D::Matrix* ReserveInstances(int currentFrame, size_t instanceCount) const;
+        uint32_t UpdateViewUniforms() const;
+        void WriteViewDescriptor(int frame) const;
+        void RecordBatches(VkCommandBuffer commandBuffer, int currentFrame, size_t firstBatch, size_t lastBatch, uint32_t viewOffset, KEngine2D::Matrix* instances, RecordState& state) const;
+        void BindObjectSet(VkCommandBuffer commandBuffer, int currentFrame, SpriteGraphic* graphic, const KEngine2D::Matrix& model, const DataLayout* layout, RecordState& state) const;
 
         VulkanCore*                   mCore;
-        std::list<SpriteGraphic*>     mRenderList;
+        std::vector<RenderEntry>      mRenderList;
+        std::vector<RenderSlot>       mRenderSlots;
+        std::vector<uint32_t>         mFreeRenderSlots;
+        uint64_t                      mNextRenderSequence;
         bool                          mInitialized;
         int                           mWidth;
         int                           mHeight;
         KEngine2D::Matrix             mProjection;
+        std::vector<VkDescriptorSet>  mViewDescriptorSets;
+        mutable std::vector<uint64_t> mViewSetGenerations; // Frame uniform arena each view set was written against
+        std::chrono::steady_clock::time_point mStartTime;
+        std::bitset<256>              mTransparentLayers;
+        bool                          mCullingEnabled;
+        std::optional<VkRect2D>       mScissor;
+        std::vector<StaticEntry>      mStaticList;
+        std::unordered_map<uint64_t, std::vector<uint32_t>> mStaticCells; // Cell of each bounds center, holding mStaticList indices
+        std::vector<uint32_t>         mStaticOversized; // Statics too large for the grid, always candidates
+        float                         mStaticCellSize;
+        mutable float                 mStaticMaxExtent; // Largest half extent in the grid, how far it is loose, never above the cell size
+        mutable bool                  mStaticMaxExtentStale; // The largest entry left the grid, recomputed on the next Render
+
+        //Per-frame scratch, rebuilt every Render
+        mutable std::vector<RenderEntry>                             mFrameEntries; // Dynamic graphics, then static candidates
+        mutable std::vector<uint32_t>                                mStaticCandidates;
+        mutable std::vector<float>                                   mTranslationX; // SoA transforms, indexed like mFrameEntries
+        mutable std::vector<float>                                   mTranslationY;
+        mutable std::vector<float>                                   mRotation;     // Plain transforms only
+        mutable std::vector<float>                                   mScale;
+        mutable std::vector<float>                                   mLinear00;     // Linear part by column then row, like Matrix::data
+        mutable std::vector<float>                                   mLinear01;
+        mutable std::vector<float>                                   mLinear10;
+        mutable std::vector<float>                                   mLinear11;
+        mutable std::vector<uint32_t>                                mExactSlots;   // Into mExactMatrices, or NO_EXACT_MATRIX for plain transforms
+        mutable std::vector<KEngine2D::Matrix>                       mExactMatrices; // GetAsMatrix of everything not composed in the batched pass
+        mutable std::vector<float>                                   mSpriteWidth;
+        mutable std::vector<float>                                   mSpriteHeight;
+        mutable std::vector<uint32_t>                                mDrawIndices;  // Transform index of each graphic in draw order
+        mutable std::vector<uint8_t>                                 mVisible;
+        mutable std::vector<SortEntry>                               mSortEntries;
+        mutable std::vector<SortEntry>                               mSortScratch;
+        mutable std::unordered_map<uint64_t, uint64_t>               mPipelineIds;
+        mutable std::unordered_map<uint64_t, uint64_t>               mTextureIds;
+        mutable std::unordered_map<uint64_t, uint64_t>               mGeometryIds;
+        mutable std::vector<Batch>                                   mBatches;
+        mutable std::vector<size_t>                                  mChunkStarts;
+        mutable std::vector<RecordState>                             mRecordStates;
+        mutable RenderStats                                          mRenderStats{};
+        mutable std::vector<std::pair<VkBuffer, VmaAllocation>>      mInstanceBuffers;
+        mutable std::vector<KEngine2D::Matrix*>                      mInstanceData;
+        mutable std::vector<float*>                                  mInstanceUvData; // UV transforms, after capacity model matrices in the same buffer
+        mutable bool                                                 mWriteInstanceUvs{ false }; // A batch this frame streams UVs
+        mutable std::vector<size_t>                                  mInstanceCapacities;
 
     };
+
+    //Times the batched model matrix pass Render uses for plain transforms against one GetAsMatrix per object,
+    //both visiting the transforms in a shuffled order as sorting leaves them. Render only takes the batched pass for
+    //graphics opted in with SpriteGraphic::SetPlainTransform, every other graphic still pays GetAsMatrix.
+    struct TransformBenchmark
+    {
+        size_t spriteCount;
+        double perObjectSeconds;
+        double batchedSeconds;
+    };
+    TransformBenchmark BenchmarkModelMatrices(const std::vector<const KEngine2D::Transform*>& transforms, int iterations = 100);
+    std::vector<TransformBenchmark> BenchmarkModelMatrices(int iterations = 100); // Generated plain transforms, 1k, 10k and 100k of them
 }
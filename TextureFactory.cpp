@@ -3,62 +3,1305 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 #include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+#include <cmath>
+#include <cctype>
+#include <fstream>
+#include <chrono>
+#include <exception>
+#include <iostream>
 
 
 void KEngineVulkan::TextureFactory::Init(VulkanCore* core)
 {
 	mCore = core;
 	mTextures.clear();
+	mAtlases.clear();
+	mAtlasRegions.clear();
+
+	//Stands in for streamed textures until they land, and for names that were never loaded
+	const uint8_t grey[2 * 2 * 4] = { 128, 128, 128, 255, 128, 128, 128, 255, 128, 128, 128, 255, 128, 128, 128, 255 };
+	UploadTexture(grey, 2, 2, mPlaceholder);
 }
 
 void KEngineVulkan::TextureFactory::Deinit()
 {
+    WaitForDecodes();
+    for (auto & upload : mStreamingUploads) {
+        mCore->waitForUpload(upload.token);
+        vkDestroyImageView(mCore->getDevice(), upload.texture.textureImageView, nullptr);
+        vmaDestroyImage(mCore->getAllocator(), upload.texture.textureImage, upload.texture.textureImageAllocation);
+    }
+    mStreamingUploads.clear();
+    mStreamingDecoded.clear();
+    mStreamingTextures.clear();
+    mStreamingNames.clear();
+    mResidencyStats = {};
+    if (mPlaceholder.textureImage != VK_NULL_HANDLE) {
+        vkDestroyImageView(mCore->getDevice(), mPlaceholder.textureImageView, nullptr);
+        vmaDestroyImage(mCore->getAllocator(), mPlaceholder.textureImage, mPlaceholder.textureImageAllocation);
+        mPlaceholder = { VK_NULL_HANDLE, VK_NULL_HANDLE, VK_NULL_HANDLE };
+    }
     for (auto & texturePair : mTextures) {
         auto & textureStruct = texturePair.second;
+        if (textureStruct.textureImage == VK_NULL_HANDLE) {
+            continue; // Atlas region, the page is destroyed with its atlas
+        }
         vkDestroyImageView(mCore->getDevice(), textureStruct.textureImageView, nullptr);
         vmaDestroyImage(mCore->getAllocator(), textureStruct.textureImage, textureStruct.textureImageAllocation);
     }
     mTextures.clear();
+    for (auto & atlasPair : mAtlases) {
+        for (auto & page : atlasPair.second.pages) {
+            vkDestroyImageView(mCore->getDevice(), page.textureImageView, nullptr);
+            vmaDestroyImage(mCore->getAllocator(), page.textureImage, page.textureImageAllocation);
+        }
+    }
+    mAtlases.clear();
+    mAtlasRegions.clear();
+}
+
+static bool HasExtension(const std::string& filename, const std::string& extension)
+{
+    if (filename.size() < extension.size()) {
+        return false;
+    }
+    return std::equal(extension.begin(), extension.end(), filename.end() - extension.size(), [](char a, char b) {
+        return a == tolower((unsigned char)b);
+    });
 }
 
 void KEngineVulkan::TextureFactory::CreateTexture(KEngineCore::StringHash name, const std::string& textureFilename)
 {
     Texture texture;
+    UploadImage(DecodeTexture(textureFilename), texture);
+    mTextures[name] = texture;
+}
+
+std::vector<KEngineVulkan::TextureFactory::TextureLoadTiming> KEngineVulkan::TextureFactory::CreateTextures(const std::vector<std::pair<KEngineCore::StringHash, std::string>>& textures)
+{
+    struct Decoded
+    {
+        size_t index;
+        LoadedImage image;
+        double decodeSeconds;
+        std::exception_ptr error;
+    };
+    std::vector<Decoded> ready;
+    std::mutex readyMutex;
+    std::condition_variable readyCondition;
+
+    //Once a decode is queued it points at these locals, so nothing below may leave before every queued job has reported.
+    //A job's report is its last touch of them
+    std::vector<TextureLoadTiming> timings(textures.size());
+    std::exception_ptr error;
+    size_t queued = 0;
+    try {
+        for (; queued < textures.size(); queued++) {
+            size_t i = queued;
+            QueueDecode([this, i, &textures, &ready, &readyMutex, &readyCondition] {
+                Decoded decoded{ i };
+                auto start = std::chrono::steady_clock::now();
+                try {
+                    decoded.image = DecodeTexture(textures[i].second);
+                }
+                catch (...) {
+                    decoded.error = std::current_exception();
+                }
+                decoded.decodeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                //Notified under the lock: once the caller can see the last result it may return and take readyCondition with it
+                std::lock_guard<std::mutex> lock(readyMutex);
+                ready.push_back(std::move(decoded));
+                readyCondition.notify_one();
+            });
+        }
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+
+    bool ownBatch = !mCore->inUploadBatch();
+    bool batchOpen = false;
+    if (ownBatch && !error) {
+        try {
+            mCore->beginUploadBatch();
+            batchOpen = true;
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+    }
+    bool batchHasWork = false;
+    for (size_t reported = 0; reported < queued; reported++) {
+        std::unique_lock<std::mutex> lock(readyMutex);
+        if (ready.empty() && batchOpen && batchHasWork && !error) {
+            lock.unlock();
+            //A failed flush leaves the batch unusable, so it is not flushed again on the way out
+            try {
+                batchOpen = false;
+                mCore->flushUploadBatch();
+                batchHasWork = false;
+                mCore->beginUploadBatch();
+                batchOpen = true;
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+            lock.lock();
+        }
+        readyCondition.wait(lock, [&ready] { return !ready.empty(); });
+        Decoded decoded = std::move(ready.back());
+        ready.pop_back();
+        lock.unlock();
+
+        TextureLoadTiming& timing = timings[decoded.index];
+        timing.name = textures[decoded.index].first;
+        timing.decodeSeconds = decoded.decodeSeconds;
+        timing.uploadSeconds = 0.0;
+        //After a failure keep draining, the queued decodes still point at this call's locals
+        if (decoded.error || error) {
+            error = error ? error : decoded.error;
+            continue;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        try {
+            Texture texture;
+            UploadImage(decoded.image, texture);
+            mTextures[timing.name] = texture;
+            batchHasWork = true;
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+        timing.uploadSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    if (batchOpen) {
+        try {
+            mCore->flushUploadBatch();
+        }
+        catch (...) {
+            error = error ? error : std::current_exception();
+        }
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return timings;
+}
+
+KEngineVulkan::TextureHandle KEngineVulkan::TextureFactory::LoadTextureAsync(KEngineCore::StringHash name, const std::string& textureFilename)
+{
+    auto found = mStreamingNames.find(name);
+    if (found != mStreamingNames.end()) {
+        return { found->second };
+    }
+
+    uint32_t index = static_cast<uint32_t>(mStreamingTextures.size());
+    mStreamingNames[name] = index;
+    auto loaded = mTextures.find(name);
+    if (loaded != mTextures.end()) {
+        mStreamingTextures.push_back({ name, std::string(), TextureState::Ready, loaded->second.textureImageView, mNextTextureVersion++, 0, 0, mStreamingFrame });
+        return { index };
+    }
+    mStreamingTextures.push_back({ name, textureFilename, TextureState::Loading, mPlaceholder.textureImageView, mNextTextureVersion++, 0, 0, mStreamingFrame });
+    QueueStreamingDecode(index, textureFilename);
+    return { index };
+}
+
+void KEngineVulkan::TextureFactory::QueueStreamingDecode(uint32_t index, const std::string& textureFilename)
+{
+    QueueDecode([this, index, textureFilename] {
+        StreamingDecode decoded{ index };
+        try {
+            decoded.image = DecodeTexture(textureFilename);
+            decoded.failed = false;
+        }
+        catch (const std::exception& exception) {
+            std::cerr << "failed to stream " << textureFilename << ": " << exception.what() << std::endl;
+            decoded.failed = true;
+        }
+        catch (...) {
+            std::cerr << "failed to stream " << textureFilename << std::endl;
+            decoded.failed = true;
+        }
+        std::lock_guard<std::mutex> lock(mStreamingMutex);
+        mStreamingDecoded.push_back(std::move(decoded));
+    });
+}
+
+KEngineVulkan::TextureHandle KEngineVulkan::TextureFactory::GetTextureHandle(KEngineCore::StringHash name) const
+{
+    auto found = mStreamingNames.find(name);
+    return found != mStreamingNames.end() ? TextureHandle{ found->second } : TextureHandle{};
+}
+
+VkImageView KEngineVulkan::TextureFactory::GetTexture(TextureHandle handle) const
+{
+    assert(handle.IsValid() && handle.index < mStreamingTextures.size());
+    const StreamingTexture& streaming = mStreamingTextures[handle.index];
+    streaming.lastUsedFrame = mStreamingFrame;
+    return streaming.view;
+}
+
+uint64_t KEngineVulkan::TextureFactory::GetTextureVersion(TextureHandle handle) const
+{
+    assert(handle.IsValid() && handle.index < mStreamingTextures.size());
+    return mStreamingTextures[handle.index].version;
+}
+
+KEngineVulkan::TextureFactory::TextureState KEngineVulkan::TextureFactory::GetTextureState(TextureHandle handle) const
+{
+    assert(handle.IsValid() && handle.index < mStreamingTextures.size());
+    return mStreamingTextures[handle.index].state;
+}
+
+void KEngineVulkan::TextureFactory::UpdateStreaming()
+{
+    assert(!mCore->inRenderPass()); // Views only change between frames
+    assert(!mCore->inUploadBatch()); // Needs a token of its own
+
+    mStreamingFrame++;
+
+    //Evicted textures resolved since they went out come back through the worker pool
+    for (uint32_t index = 0; index < mStreamingTextures.size(); index++) {
+        StreamingTexture& streaming = mStreamingTextures[index];
+        if (streaming.state == TextureState::Evicted && streaming.lastUsedFrame >= streaming.evictedFrame) {
+            streaming.state = TextureState::Loading;
+            QueueStreamingDecode(index, streaming.filename);
+            mResidencyStats.reloads++;
+        }
+    }
+
+    std::vector<StreamingDecode> decoded;
+    {
+        std::lock_guard<std::mutex> lock(mStreamingMutex);
+        decoded.swap(mStreamingDecoded);
+    }
+
+    //Everything decoded since last frame goes up in one batch. An image that fails to upload only fails its own handle,
+    //the rest still go up and the batch is always closed
+    size_t firstNew = mStreamingUploads.size();
+    if (!decoded.empty()) {
+        mCore->beginUploadBatch();
+        for (StreamingDecode& image : decoded) {
+            StreamingTexture& streaming = mStreamingTextures[image.index];
+            if (image.failed) {
+                streaming.state = TextureState::Failed; // Keeps the placeholder
+                continue;
+            }
+            StreamingUpload upload{ image.index };
+            try {
+                UploadImage(image.image, upload.texture);
+                mStreamingUploads.push_back(upload);
+            }
+            catch (const std::exception& exception) {
+                std::cerr << "failed to upload " << streaming.filename << ": " << exception.what() << std::endl;
+                streaming.state = TextureState::Failed;
+            }
+            catch (...) {
+                std::cerr << "failed to upload " << streaming.filename << std::endl;
+                streaming.state = TextureState::Failed;
+            }
+        }
+        VulkanCore::UploadToken token;
+        try {
+            token = mCore->flushUploadBatch();
+        }
+        catch (...) {
+            //Without a token these would never complete, the images stay alive since the failed batch still records into them
+            for (size_t i = firstNew; i < mStreamingUploads.size(); i++) {
+                mStreamingTextures[mStreamingUploads[i].index].state = TextureState::Failed;
+            }
+            mStreamingUploads.resize(firstNew);
+            throw;
+        }
+        for (size_t i = firstNew; i < mStreamingUploads.size(); i++) {
+            mStreamingUploads[i].token = token;
+        }
+    }
+
+    //Swap in whatever has finished, sprites notice the new view when they next draw
+    for (size_t i = 0; i < mStreamingUploads.size();) {
+        StreamingUpload& upload = mStreamingUploads[i];
+        if (!mCore->isUploadComplete(upload.token)) {
+            i++;
+            continue;
+        }
+        StreamingTexture& streaming = mStreamingTextures[upload.index];
+        assert(mTextures.find(streaming.name) == mTextures.end());
+        mTextures[streaming.name] = upload.texture;
+        VmaAllocationInfo allocationInfo;
+        vmaGetAllocationInfo(mCore->getAllocator(), upload.texture.textureImageAllocation, &allocationInfo);
+        streaming.view = upload.texture.textureImageView;
+        streaming.state = TextureState::Ready;
+        streaming.version = mNextTextureVersion++;
+        streaming.bytes = allocationInfo.size;
+        streaming.lastUsedFrame = mStreamingFrame; // Not an eviction candidate before anything has had a chance to draw it
+        mResidencyStats.residentBytes += streaming.bytes;
+        upload = mStreamingUploads.back();
+        mStreamingUploads.pop_back();
+    }
+
+    EnforceResidencyBudget();
+}
+
+void KEngineVulkan::TextureFactory::SetResidencyBudget(VkDeviceSize bytes)
+{
+    mResidencyBudget = bytes;
+}
+
+const KEngineVulkan::TextureFactory::ResidencyStats& KEngineVulkan::TextureFactory::GetResidencyStats() const
+{
+    return mResidencyStats;
+}
+
+bool KEngineVulkan::TextureFactory::OverResidencyBudget() const
+{
+    if (mResidencyBudget != 0) {
+        return mResidencyStats.residentBytes > mResidencyBudget;
+    }
+
+    VmaBudget budgets[VK_MAX_MEMORY_HEAPS];
+    vmaGetHeapBudgets(mCore->getAllocator(), budgets);
+    const VkPhysicalDeviceMemoryProperties* memoryProperties;
+    vmaGetMemoryProperties(mCore->getAllocator(), &memoryProperties);
+    for (uint32_t heap = 0; heap < memoryProperties->memoryHeapCount; heap++) {
+        if ((memoryProperties->memoryHeaps[heap].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) && budgets[heap].usage > budgets[heap].budget / 10 * 9) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void KEngineVulkan::TextureFactory::EnforceResidencyBudget()
+{
+    if (!OverResidencyBudget()) {
+        return;
+    }
+
+    //Anything resolved within the frames in flight may still be read by the GPU, the rest go least recently used first
+    uint64_t framesInFlight = static_cast<uint64_t>(mCore->getMaxFramesInFlight());
+    std::vector<uint32_t> candidates;
+    for (uint32_t index = 0; index < mStreamingTextures.size(); index++) {
+        const StreamingTexture& streaming = mStreamingTextures[index];
+        if (streaming.state == TextureState::Ready && !streaming.filename.empty() && mStreamingFrame - streaming.lastUsedFrame > framesInFlight) {
+            candidates.push_back(index);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(), [this](uint32_t a, uint32_t b) {
+        return mStreamingTextures[a].lastUsedFrame < mStreamingTextures[b].lastUsedFrame;
+    });
+    for (uint32_t index : candidates) {
+        EvictTexture(index);
+        if (!OverResidencyBudget()) {
+            break;
+        }
+    }
+}
+
+void KEngineVulkan::TextureFactory::EvictTexture(uint32_t index)
+{
+    StreamingTexture& streaming = mStreamingTextures[index];
+    auto found = mTextures.find(streaming.name);
+    assert(found != mTextures.end());
+    vkDestroyImageView(mCore->getDevice(), found->second.textureImageView, nullptr);
+    vmaDestroyImage(mCore->getAllocator(), found->second.textureImage, found->second.textureImageAllocation);
+    mTextures.erase(found);
+
+    mResidencyStats.residentBytes -= streaming.bytes;
+    mResidencyStats.evictions++;
+    streaming.bytes = 0;
+    streaming.view = mPlaceholder.textureImageView;
+    streaming.state = TextureState::Evicted;
+    streaming.version = mNextTextureVersion++;
+    streaming.evictedFrame = mStreamingFrame;
+}
+
+void KEngineVulkan::TextureFactory::QueueDecode(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mDecodeMutex);
+        mPendingDecodes++;
+    }
+    auto finished = [this] {
+        std::lock_guard<std::mutex> lock(mDecodeMutex);
+        if (--mPendingDecodes == 0) {
+            mDecodeCondition.notify_all();
+        }
+    };
+    try {
+        mCore->getWorkerPool().Queue([job = std::move(job), finished] {
+            //Counted off even if the job throws, or WaitForDecodes would wait forever
+            try {
+                job();
+            }
+            catch (...) {
+                finished();
+                throw;
+            }
+            finished();
+        });
+    }
+    catch (...) {
+        finished();
+        throw;
+    }
+}
+
+void KEngineVulkan::TextureFactory::WaitForDecodes()
+{
+    std::unique_lock<std::mutex> lock(mDecodeMutex);
+    mDecodeCondition.wait(lock, [this] { return mPendingDecodes == 0; });
+}
+
+void KEngineVulkan::TextureFactory::UploadTexture(const uint8_t* pixels, uint32_t width, uint32_t height, Texture& texture, VkFormat format, uint32_t maxMipLevels)
+{
+    assert(format == VK_FORMAT_R8G8B8A8_SRGB || format == VK_FORMAT_R8G8B8A8_UNORM);
+    assert(maxMipLevels > 0);
+    VkDeviceSize imageSize = (VkDeviceSize)width * height * 4;
+    uint32_t mipLevels = std::min(VulkanCore::mipLevelCount(width, height), maxMipLevels);
+    bool blitMipmaps = mCore->supportsLinearBlit(format);
+
+    //Joins the caller's upload batch if there is one, so a whole level can load with a single submit
+    bool ownBatch = !mCore->inUploadBatch();
+    if (ownBatch) {
+        mCore->beginUploadBatch();
+    }
+
+    VulkanCore::StagingAllocation staging = mCore->allocateStaging(imageSize);
+    memcpy(staging.data, pixels, static_cast<size_t>(imageSize));
+
+    mCore->createImage(width, height, format, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, texture.textureImage, texture.textureImageAllocation, mipLevels);
+
+    mCore->transitionImageLayout(texture.textureImage, format, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0, mipLevels);
+    mCore->copyBufferToImage(staging.buffer, texture.textureImage, width, height, staging.offset);
+    if (blitMipmaps) {
+        mCore->generateMipmaps(texture.textureImage, format, width, height, mipLevels);
+    }
+    else {
+        //No linear blits for this format, build each level from the one above it and stage it like level 0
+        std::vector<uint8_t> level(pixels, pixels + imageSize);
+        std::vector<uint8_t> nextLevel;
+        uint32_t levelWidth = width;
+        uint32_t levelHeight = height;
+        for (uint32_t mip = 1; mip < mipLevels; mip++) {
+            uint32_t nextWidth = std::max(levelWidth / 2, 1u);
+            uint32_t nextHeight = std::max(levelHeight / 2, 1u);
+            nextLevel.resize((size_t)nextWidth * nextHeight * 4);
+            Downsample(level.data(), levelWidth, levelHeight, nextLevel.data(), format == VK_FORMAT_R8G8B8A8_SRGB);
+
+            VulkanCore::StagingAllocation levelStaging = mCore->allocateStaging(nextLevel.size());
+            memcpy(levelStaging.data, nextLevel.data(), nextLevel.size());
+            mCore->copyBufferToImage(levelStaging.buffer, texture.textureImage, nextWidth, nextHeight, levelStaging.offset, mip);
+
+            level.swap(nextLevel);
+            levelWidth = nextWidth;
+            levelHeight = nextHeight;
+        }
+        mCore->transitionImageLayout(texture.textureImage, format, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 0, mipLevels);
+    }
+    if (ownBatch) {
+        mCore->flushUploadBatch();
+    }
+
+    texture.textureImageView = mCore->createImageView(texture.textureImage, format, mipLevels);
+}
+
+//2x2 box filter, sRGB is averaged in linear space so the smaller levels don't darken. Odd edges clamp, so a 1 pixel dimension just halves the other one
+void KEngineVulkan::TextureFactory::Downsample(const uint8_t* source, uint32_t width, uint32_t height, uint8_t* destination, bool srgb)
+{
+    static const std::vector<float> toLinear = [] {
+        std::vector<float> table(256);
+        for (int i = 0; i < 256; i++) {
+            float c = i / 255.0f;
+            table[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+        }
+        return table;
+    }();
+
+    uint32_t nextWidth = std::max(width / 2, 1u);
+    uint32_t nextHeight = std::max(height / 2, 1u);
+    for (uint32_t y = 0; y < nextHeight; y++) {
+        uint32_t y0 = std::min(y * 2, height - 1);
+        uint32_t y1 = std::min(y * 2 + 1, height - 1);
+        for (uint32_t x = 0; x < nextWidth; x++) {
+            uint32_t x0 = std::min(x * 2, width - 1);
+            uint32_t x1 = std::min(x * 2 + 1, width - 1);
+            const uint8_t* texels[4] = {
+                source + ((size_t)y0 * width + x0) * 4,
+                source + ((size_t)y0 * width + x1) * 4,
+                source + ((size_t)y1 * width + x0) * 4,
+                source + ((size_t)y1 * width + x1) * 4,
+            };
+            uint8_t* out = destination + ((size_t)y * nextWidth + x) * 4;
+            int srgbChannels = srgb ? 3 : 0;
+            for (int channel = 0; channel < srgbChannels; channel++) {
+                float c = 0.25f * (toLinear[texels[0][channel]] + toLinear[texels[1][channel]] + toLinear[texels[2][channel]] + toLinear[texels[3][channel]]);
+                c = c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+                out[channel] = static_cast<uint8_t>(std::min(std::max(c, 0.0f), 1.0f) * 255.0f + 0.5f);
+            }
+            for (int channel = srgbChannels; channel < 4; channel++) { // Alpha is always stored linearly
+                out[channel] = static_cast<uint8_t>((texels[0][channel] + texels[1][channel] + texels[2][channel] + texels[3][channel] + 2) / 4);
+            }
+        }
+    }
+}
+
+//Bytes per 4x4 block, or per texel for the uncompressed formats a container may also hold. 0 for anything we can't upload
+static uint32_t BlockBytes(VkFormat format)
+{
+    switch (format) {
+    case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+    case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+    case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+    case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+    case VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK:
+    case VK_FORMAT_ETC2_R8G8B8_SRGB_BLOCK:
+        return 8;
+    case VK_FORMAT_BC3_UNORM_BLOCK:
+    case VK_FORMAT_BC3_SRGB_BLOCK:
+    case VK_FORMAT_BC7_UNORM_BLOCK:
+    case VK_FORMAT_BC7_SRGB_BLOCK:
+    case VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK:
+    case VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK:
+        return 16;
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+static bool IsBlockCompressed(VkFormat format)
+{
+    return format != VK_FORMAT_R8G8B8A8_UNORM && format != VK_FORMAT_R8G8B8A8_SRGB;
+}
+
+static size_t LevelSize(VkFormat format, uint32_t width, uint32_t height)
+{
+    if (!IsBlockCompressed(format)) {
+        return (size_t)width * height * 4;
+    }
+    return (((size_t)width + 3) / 4) * (((size_t)height + 3) / 4) * BlockBytes(format);
+}
+
+static uint32_t ReadU32(const std::vector<uint8_t>& file, size_t offset)
+{
+    if (offset + 4 > file.size()) {
+        throw std::runtime_error("failed to load texture image, file is truncated!");
+    }
+    uint32_t value;
+    memcpy(&value, file.data() + offset, 4);
+    return value;
+}
+
+static uint64_t ReadU64(const std::vector<uint8_t>& file, size_t offset)
+{
+    return ReadU32(file, offset) | ((uint64_t)ReadU32(file, offset + 4) << 32);
+}
+
+KEngineVulkan::TextureFactory::LoadedImage KEngineVulkan::TextureFactory::LoadKTX2(std::vector<uint8_t>&& file)
+{
+    static const uint8_t identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+    if (file.size() < 80 || memcmp(file.data(), identifier, sizeof(identifier)) != 0) {
+        throw std::runtime_error("failed to load texture image, not a KTX2 file!");
+    }
+
+    LoadedImage image;
+    image.format = (VkFormat)ReadU32(file, 12);
+    image.width = ReadU32(file, 20);
+    image.height = ReadU32(file, 24);
+    uint32_t depth = ReadU32(file, 28);
+    uint32_t layerCount = ReadU32(file, 32);
+    uint32_t faceCount = ReadU32(file, 36);
+    uint32_t levelCount = std::max(ReadU32(file, 40), 1u); // 0 asks the loader to generate mips, which block formats can't blit
+    uint32_t supercompression = ReadU32(file, 44);
+
+    if (image.format == VK_FORMAT_UNDEFINED || supercompression != 0) {
+        throw std::runtime_error("failed to load texture image, supercompressed KTX2 needs a transcoder!");
+    }
+    if (BlockBytes(image.format) == 0) {
+        throw std::runtime_error("failed to load texture image, unsupported KTX2 format!");
+    }
+    if (depth > 1 || layerCount > 1 || faceCount != 1 || image.width == 0 || image.height == 0) {
+        throw std::runtime_error("failed to load texture image, only single 2D KTX2 images are supported!");
+    }
+    if (levelCount > VulkanCore::mipLevelCount(image.width, image.height)) {
+        throw std::runtime_error("failed to load texture image, more KTX2 levels than the image has mips!");
+    }
+
+    //The level index follows the 80 byte header, level 0 first even though the data itself is stored smallest first
+    for (uint32_t level = 0; level < levelCount; level++) {
+        uint64_t offset = ReadU64(file, 80 + level * 24);
+        uint32_t levelWidth = std::max(image.width >> level, 1u);
+        uint32_t levelHeight = std::max(image.height >> level, 1u);
+        size_t levelSize = LevelSize(image.format, levelWidth, levelHeight);
+        if (offset > file.size() || levelSize > file.size() - offset) {
+            throw std::runtime_error("failed to load texture image, file is truncated!");
+        }
+        image.levelOffsets.push_back(static_cast<size_t>(offset));
+    }
+    image.data = std::move(file);
+    return image;
+}
+
+KEngineVulkan::TextureFactory::LoadedImage KEngineVulkan::TextureFactory::LoadDDS(std::vector<uint8_t>&& file)
+{
+    const uint32_t DDSD_MIPMAPCOUNT = 0x20000;
+    const uint32_t DXGI_FORMAT_R8G8B8A8_UNORM = 28, DXGI_FORMAT_R8G8B8A8_UNORM_SRGB = 29;
+    const uint32_t DXGI_FORMAT_BC1_UNORM = 71, DXGI_FORMAT_BC1_UNORM_SRGB = 72;
+    const uint32_t DXGI_FORMAT_BC3_UNORM = 77, DXGI_FORMAT_BC3_UNORM_SRGB = 78;
+    const uint32_t DXGI_FORMAT_BC7_UNORM = 98, DXGI_FORMAT_BC7_UNORM_SRGB = 99;
+    const uint32_t D3D10_RESOURCE_DIMENSION_TEXTURE2D = 3;
+
+    if (file.size() < 128 || memcmp(file.data(), "DDS ", 4) != 0 || ReadU32(file, 4) != 124) {
+        throw std::runtime_error("failed to load texture image, not a DDS file!");
+    }
+
+    LoadedImage image;
+    image.format = VK_FORMAT_UNDEFINED;
+    image.height = ReadU32(file, 12);
+    image.width = ReadU32(file, 16);
+    uint32_t levelCount = (ReadU32(file, 8) & DDSD_MIPMAPCOUNT) ? std::max(ReadU32(file, 28), 1u) : 1;
+    size_t dataOffset = 128;
+
+    //Legacy FourCCs carry no color space, textures here are sRGB unless a DX10 header says otherwise
+    const uint8_t* fourCC = file.data() + 84;
+    if (memcmp(fourCC, "DXT1", 4) == 0) {
+        image.format = VK_FORMAT_BC1_RGBA_SRGB_BLOCK;
+    }
+    else if (memcmp(fourCC, "DXT5", 4) == 0) {
+        image.format = VK_FORMAT_BC3_SRGB_BLOCK;
+    }
+    else if (memcmp(fourCC, "DX10", 4) == 0) {
+        if (ReadU32(file, 132) != D3D10_RESOURCE_DIMENSION_TEXTURE2D || ReadU32(file, 140) > 1) {
+            throw std::runtime_error("failed to load texture image, only single 2D DDS images are supported!");
+        }
+        switch (ReadU32(file, 128)) {
+        case DXGI_FORMAT_R8G8B8A8_UNORM: image.format = VK_FORMAT_R8G8B8A8_UNORM; break;
+        case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB: image.format = VK_FORMAT_R8G8B8A8_SRGB; break;
+        case DXGI_FORMAT_BC1_UNORM: image.format = VK_FORMAT_BC1_RGBA_UNORM_BLOCK; break;
+        case DXGI_FORMAT_BC1_UNORM_SRGB: image.format = VK_FORMAT_BC1_RGBA_SRGB_BLOCK; break;
+        case DXGI_FORMAT_BC3_UNORM: image.format = VK_FORMAT_BC3_UNORM_BLOCK; break;
+        case DXGI_FORMAT_BC3_UNORM_SRGB: image.format = VK_FORMAT_BC3_SRGB_BLOCK; break;
+        case DXGI_FORMAT_BC7_UNORM: image.format = VK_FORMAT_BC7_UNORM_BLOCK; break;
+        case DXGI_FORMAT_BC7_UNORM_SRGB: image.format = VK_FORMAT_BC7_SRGB_BLOCK; break;
+        default: break;
+        }
+        dataOffset += 20;
+    }
+    if (image.format == VK_FORMAT_UNDEFINED) {
+        throw std::runtime_error("failed to load texture image, unsupported DDS format!");
+    }
+    if (image.width == 0 || image.height == 0) {
+        throw std::runtime_error("failed to load texture image, only single 2D DDS images are supported!");
+    }
+    if (levelCount > VulkanCore::mipLevelCount(image.width, image.height)) {
+        throw std::runtime_error("failed to load texture image, more DDS levels than the image has mips!");
+    }
+
+    //Levels are packed back to back, largest first
+    for (uint32_t level = 0; level < levelCount; level++) {
+        uint32_t levelWidth = std::max(image.width >> level, 1u);
+        uint32_t levelHeight = std::max(image.height >> level, 1u);
+        size_t levelSize = LevelSize(image.format, levelWidth, levelHeight);
+        if (dataOffset > file.size() || levelSize > file.size() - dataOffset) {
+            throw std::runtime_error("failed to load texture image, file is truncated!");
+        }
+        image.levelOffsets.push_back(dataOffset);
+        dataOffset += levelSize;
+    }
+    image.data = std::move(file);
+    return image;
+}
+
+//CPU decoders for when the device can't sample a block format. Each writes one 4x4 block of RGBA8 texels, row by row
+static void DecodeBC1Block(const uint8_t* block, uint8_t* texels, bool opaqueOnly)
+{
+    uint16_t color0 = (uint16_t)(block[0] | (block[1] << 8));
+    uint16_t color1 = (uint16_t)(block[2] | (block[3] << 8));
+    uint8_t palette[4][4];
+    for (int i = 0; i < 2; i++) {
+        uint16_t color = i == 0 ? color0 : color1;
+        uint32_t r = (color >> 11) & 0x1F, g = (color >> 5) & 0x3F, b = color & 0x1F;
+        palette[i][0] = (uint8_t)((r << 3) | (r >> 2));
+        palette[i][1] = (uint8_t)((g << 2) | (g >> 4));
+        palette[i][2] = (uint8_t)((b << 3) | (b >> 2));
+        palette[i][3] = 255;
+    }
+    //BC3 color blocks always use four colors, BC1 switches to three and transparent black when the endpoints aren't ordered
+    bool fourColors = opaqueOnly || color0 > color1;
+    for (int c = 0; c < 3; c++) {
+        if (fourColors) {
+            palette[2][c] = (uint8_t)((2 * palette[0][c] + palette[1][c] + 1) / 3);
+            palette[3][c] = (uint8_t)((palette[0][c] + 2 * palette[1][c] + 1) / 3);
+        }
+        else {
+            palette[2][c] = (uint8_t)((palette[0][c] + palette[1][c] + 1) / 2);
+            palette[3][c] = 0;
+        }
+    }
+    palette[2][3] = 255;
+    palette[3][3] = fourColors ? 255 : 0;
+
+    uint32_t indices = block[4] | (block[5] << 8) | (block[6] << 16) | ((uint32_t)block[7] << 24);
+    for (int i = 0; i < 16; i++) {
+        memcpy(texels + i * 4, palette[(indices >> (2 * i)) & 3], 4);
+    }
+}
+
+static void DecodeBC3AlphaBlock(const uint8_t* block, uint8_t* texels)
+{
+    uint32_t alpha[8];
+    alpha[0] = block[0];
+    alpha[1] = block[1];
+    if (alpha[0] > alpha[1]) {
+        for (int i = 1; i < 7; i++) {
+            alpha[i + 1] = ((7 - i) * alpha[0] + i * alpha[1] + 3) / 7;
+        }
+    }
+    else {
+        for (int i = 1; i < 5; i++) {
+            alpha[i + 1] = ((5 - i) * alpha[0] + i * alpha[1] + 2) / 5;
+        }
+        alpha[6] = 0;
+        alpha[7] = 255;
+    }
+
+    uint64_t indices = 0;
+    for (int i = 0; i < 6; i++) {
+        indices |= (uint64_t)block[2 + i] << (8 * i);
+    }
+    for (int i = 0; i < 16; i++) {
+        texels[i * 4 + 3] = (uint8_t)alpha[(indices >> (3 * i)) & 7];
+    }
+}
+
+static uint8_t Clamp255(int value)
+{
+    return (uint8_t)std::min(std::max(value, 0), 255);
+}
+
+static uint64_t ReadBigEndian64(const uint8_t* block)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | block[i];
+    }
+    return value;
+}
+
+static uint32_t Bits(uint64_t value, int high, int low)
+{
+    return (uint32_t)((value >> low) & ((1ull << (high - low + 1)) - 1));
+}
+
+//ETC2 RGB8, including the T, H and planar modes that reuse overflowing ETC1 differential encodings. Texel indices run down columns
+static void DecodeETC2ColorBlock(const uint8_t* block, uint8_t* texels)
+{
+    static const int modifiers[8][4] = {
+        { 2, 8, -2, -8 }, { 5, 17, -5, -17 }, { 9, 29, -9, -29 }, { 13, 42, -13, -42 },
+        { 18, 60, -18, -60 }, { 24, 80, -24, -80 }, { 33, 106, -33, -106 }, { 47, 183, -47, -183 },
+    };
+    static const int distances[8] = { 3, 6, 11, 16, 23, 32, 41, 64 };
+
+    uint64_t bits = ReadBigEndian64(block);
+    auto extend4 = [](uint32_t v) { return (int)((v << 4) | v); };
+    auto extend5 = [](uint32_t v) { return (int)((v << 3) | (v >> 2)); };
+    auto extend6 = [](uint32_t v) { return (int)((v << 2) | (v >> 4)); };
+    auto extend7 = [](uint32_t v) { return (int)((v << 1) | (v >> 6)); };
+    auto pixelIndex = [bits](int x, int y) {
+        int k = x * 4 + y;
+        return (int)((((bits >> (16 + k)) & 1) << 1) | ((bits >> k) & 1));
+    };
+
+    bool differential = Bits(bits, 33, 33) != 0;
+    int r = (int)Bits(bits, 63, 59), g = (int)Bits(bits, 55, 51), b = (int)Bits(bits, 47, 43);
+    int dr = ((int)Bits(bits, 58, 56) ^ 4) - 4, dg = ((int)Bits(bits, 50, 48) ^ 4) - 4, db = ((int)Bits(bits, 42, 40) ^ 4) - 4;
+
+    if (!differential || (r + dr >= 0 && r + dr <= 31 && g + dg >= 0 && g + dg <= 31 && b + db >= 0 && b + db <= 31)) {
+        int base[2][3];
+        if (differential) {
+            base[0][0] = extend5(r); base[0][1] = extend5(g); base[0][2] = extend5(b);
+            base[1][0] = extend5(r + dr); base[1][1] = extend5(g + dg); base[1][2] = extend5(b + db);
+        }
+        else {
+            base[0][0] = extend4(Bits(bits, 63, 60)); base[0][1] = extend4(Bits(bits, 55, 52)); base[0][2] = extend4(Bits(bits, 47, 44));
+            base[1][0] = extend4(Bits(bits, 59, 56)); base[1][1] = extend4(Bits(bits, 51, 48)); base[1][2] = extend4(Bits(bits, 43, 40));
+        }
+        const int* table[2] = { modifiers[Bits(bits, 39, 37)], modifiers[Bits(bits, 36, 34)] };
+        bool flip = Bits(bits, 32, 32) != 0;
+        for (int y = 0; y < 4; y++) {
+            for (int x = 0; x < 4; x++) {
+                int sub = flip ? (y >= 2) : (x >= 2);
+                int modifier = table[sub][pixelIndex(x, y)];
+                uint8_t* out = texels + (y * 4 + x) * 4;
+                for (int c = 0; c < 3; c++) {
+                    out[c] = Clamp255(base[sub][c] + modifier);
+                }
+                out[3] = 255;
+            }
+        }
+        return;
+    }
+
+    int paint[4][3];
+    if (r + dr < 0 || r + dr > 31) {
+        //T mode
+        int color1[3] = { extend4((Bits(bits, 60, 59) << 2) | Bits(bits, 57, 56)), extend4(Bits(bits, 55, 52)), extend4(Bits(bits, 51, 48)) };
+        int color2[3] = { extend4(Bits(bits, 47, 44)), extend4(Bits(bits, 43, 40)), extend4(Bits(bits, 39, 36)) };
+        int distance = distances[(Bits(bits, 35, 34) << 1) | Bits(bits, 32, 32)];
+        for (int c = 0; c < 3; c++) {
+            paint[0][c] = color1[c];
+            paint[1][c] = color2[c] + distance;
+            paint[2][c] = color2[c];
+            paint[3][c] = color2[c] - distance;
+        }
+    }
+    else if (g + dg < 0 || g + dg > 31) {
+        //H mode, the lowest distance bit is implied by the order of the two base colors
+        uint32_t r1 = Bits(bits, 62, 59), g1 = (Bits(bits, 58, 56) << 1) | Bits(bits, 52, 52), b1 = (Bits(bits, 51, 51) << 3) | Bits(bits, 49, 47);
+        uint32_t r2 = Bits(bits, 46, 43), g2 = Bits(bits, 42, 39), b2 = Bits(bits, 38, 35);
+        uint32_t order = ((r1 << 8) | (g1 << 4) | b1) >= ((r2 << 8) | (g2 << 4) | b2) ? 1 : 0;
+        int distance = distances[(Bits(bits, 34, 34) << 2) | (Bits(bits, 32, 32) << 1) | order];
+        int color1[3] = { extend4(r1), extend4(g1), extend4(b1) };
+        int color2[3] = { extend4(r2), extend4(g2), extend4(b2) };
+        for (int c = 0; c < 3; c++) {
+            paint[0][c] = color1[c] + distance;
+            paint[1][c] = color1[c] - distance;
+            paint[2][c] = color2[c] + distance;
+            paint[3][c] = color2[c] - distance;
+        }
+    }
+    else {
+        //Planar mode, a gradient from the origin, horizontal and vertical colors
+        int origin[3] = { extend6(Bits(bits, 62, 57)), extend7((Bits(bits, 56, 56) << 6) | Bits(bits, 54, 49)),
+            extend6((Bits(bits, 48, 48) << 5) | (Bits(bits, 44, 43) << 3) | Bits(bits, 41, 39)) };
+        int horizontal[3] = { extend6((Bits(bits, 38, 34) << 1) | Bits(bits, 32, 32)), extend7(Bits(bits, 31, 25)), extend6(Bits(bits, 24, 19)) };
+        int vertical[3] = { extend6(Bits(bits, 18, 13)), extend7(Bits(bits, 12, 6)), extend6(Bits(bits, 5, 0)) };
+        for (int y = 0; y < 4; y++) {
+            for (int x = 0; x < 4; x++) {
+                uint8_t* out = texels + (y * 4 + x) * 4;
+                for (int c = 0; c < 3; c++) {
+                    out[c] = Clamp255((x * (horizontal[c] - origin[c]) + y * (vertical[c] - origin[c]) + 4 * origin[c] + 2) >> 2);
+                }
+                out[3] = 255;
+            }
+        }
+        return;
+    }
+
+    for (int y = 0; y < 4; y++) {
+        for (int x = 0; x < 4; x++) {
+            uint8_t* out = texels + (y * 4 + x) * 4;
+            const int* color = paint[pixelIndex(x, y)];
+            for (int c = 0; c < 3; c++) {
+                out[c] = Clamp255(color[c]);
+            }
+            out[3] = 255;
+        }
+    }
+}
+
+static void DecodeEACAlphaBlock(const uint8_t* block, uint8_t* texels)
+{
+    static const int modifiers[16][8] = {
+        { -3, -6, -9, -15, 2, 5, 8, 14 }, { -3, -7, -10, -13, 2, 6, 9, 12 }, { -2, -5, -8, -13, 1, 4, 7, 12 }, { -2, -4, -6, -13, 1, 3, 5, 12 },
+        { -3, -6, -8, -12, 2, 5, 7, 11 }, { -3, -7, -9, -11, 2, 6, 8, 10 }, { -4, -7, -8, -11, 3, 6, 7, 10 }, { -3, -5, -8, -11, 2, 4, 7, 10 },
+        { -2, -6, -8, -10, 1, 5, 7, 9 }, { -2, -5, -8, -10, 1, 4, 7, 9 }, { -2, -4, -8, -10, 1, 3, 7, 9 }, { -2, -5, -7, -10, 1, 4, 6, 9 },
+        { -3, -4, -7, -10, 2, 3, 6, 9 }, { -1, -2, -3, -10, 0, 1, 2, 9 }, { -4, -6, -8, -9, 3, 5, 7, 8 }, { -3, -5, -7, -9, 2, 4, 6, 8 },
+    };
+
+    uint64_t bits = ReadBigEndian64(block);
+    int base = (int)Bits(bits, 63, 56);
+    int multiplier = (int)Bits(bits, 55, 52);
+    const int* table = modifiers[Bits(bits, 51, 48)];
+    for (int x = 0; x < 4; x++) {
+        for (int y = 0; y < 4; y++) {
+            int k = x * 4 + y;
+            texels[(y * 4 + x) * 4 + 3] = Clamp255(base + table[Bits(bits, 47 - 3 * k, 45 - 3 * k)] * multiplier);
+        }
+    }
+}
+
+//Decodes a whole level into RGBA8, false if there's no CPU decoder for the format
+static bool DecompressLevel(VkFormat format, const uint8_t* blocks, uint32_t width, uint32_t height, uint8_t* pixels)
+{
+    uint32_t blockBytes = BlockBytes(format);
+    uint8_t texels[16 * 4];
+    for (uint32_t blockY = 0; blockY < (height + 3) / 4; blockY++) {
+        for (uint32_t blockX = 0; blockX < (width + 3) / 4; blockX++, blocks += blockBytes) {
+            switch (format) {
+            case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+            case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+                DecodeBC1Block(blocks, texels, false);
+                for (int i = 0; i < 16; i++) {
+                    texels[i * 4 + 3] = 255; // The three color mode's transparent black is plain black without alpha
+                }
+                break;
+            case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+            case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+                DecodeBC1Block(blocks, texels, false);
+                break;
+            case VK_FORMAT_BC3_UNORM_BLOCK:
+            case VK_FORMAT_BC3_SRGB_BLOCK:
+                DecodeBC1Block(blocks + 8, texels, true);
+                DecodeBC3AlphaBlock(blocks, texels);
+                break;
+            case VK_FORMAT_ETC2_R8G8B8_UNORM_BLOCK:
+            case VK_FORMAT_ETC2_R8G8B8_SRGB_BLOCK:
+                DecodeETC2ColorBlock(blocks, texels);
+                break;
+            case VK_FORMAT_ETC2_R8G8B8A8_UNORM_BLOCK:
+            case VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK:
+                DecodeETC2ColorBlock(blocks + 8, texels);
+                DecodeEACAlphaBlock(blocks, texels);
+                break;
+            default:
+                return false;
+            }
+
+            //Blocks hanging over the right or bottom edge only write the texels inside the image
+            uint32_t columns = std::min(width - blockX * 4, 4u);
+            uint32_t rows = std::min(height - blockY * 4, 4u);
+            for (uint32_t y = 0; y < rows; y++) {
+                memcpy(pixels + ((size_t)(blockY * 4 + y) * width + blockX * 4) * 4, texels + y * 16, columns * 4);
+            }
+        }
+    }
+    return true;
+}
+
+static bool IsSRGB(VkFormat format)
+{
+    switch (format) {
+    case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+    case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+    case VK_FORMAT_BC3_SRGB_BLOCK:
+    case VK_FORMAT_BC7_SRGB_BLOCK:
+    case VK_FORMAT_ETC2_R8G8B8_SRGB_BLOCK:
+    case VK_FORMAT_ETC2_R8G8B8A8_SRGB_BLOCK:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+        return true;
+    default:
+        return false;
+    }
+}
+
+KEngineVulkan::TextureFactory::LoadedImage KEngineVulkan::TextureFactory::DecodeTexture(const std::string& textureFilename) const
+{
+    LoadedImage image;
+    if (!HasExtension(textureFilename, ".ktx2") && !HasExtension(textureFilename, ".dds")) {
+        int texWidth, texHeight, texChannels;
+        stbi_uc* pixels = stbi_load(textureFilename.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
+        if (!pixels) {
+            throw std::runtime_error("failed to load texture image!");
+        }
+        image.format = VK_FORMAT_R8G8B8A8_SRGB;
+        image.width = static_cast<uint32_t>(texWidth);
+        image.height = static_cast<uint32_t>(texHeight);
+        image.levelOffsets.push_back(0);
+        image.data.assign(pixels, pixels + (size_t)texWidth * texHeight * 4);
+        stbi_image_free(pixels);
+        return image;
+    }
+
+    std::ifstream stream(textureFilename, std::ios::binary | std::ios::ate);
+    if (!stream) {
+        throw std::runtime_error("failed to load texture image!");
+    }
+    std::vector<uint8_t> file(static_cast<size_t>(stream.tellg()));
+    stream.seekg(0);
+    stream.read(reinterpret_cast<char*>(file.data()), file.size());
+
+    image = HasExtension(textureFilename, ".ktx2") ? LoadKTX2(std::move(file)) : LoadDDS(std::move(file));
+    if (!IsBlockCompressed(image.format) || mCore->supportsSampledFormat(image.format)) {
+        return image;
+    }
+
+    //The device can't sample these blocks (BC on mobile, ETC2 on most desktops), decode level 0 and let the upload rebuild the chain
+    LoadedImage decoded;
+    decoded.format = IsSRGB(image.format) ? VK_FORMAT_R8G8B8A8_SRGB : VK_FORMAT_R8G8B8A8_UNORM;
+    decoded.width = image.width;
+    decoded.height = image.height;
+    decoded.levelOffsets.push_back(0);
+    decoded.data.resize((size_t)image.width * image.height * 4);
+    if (!DecompressLevel(image.format, image.data.data() + image.levelOffsets[0], image.width, image.height, decoded.data.data())) {
+        throw std::runtime_error("failed to load texture image, format is not supported by the device!");
+    }
+    return decoded;
+}
+
+void KEngineVulkan::TextureFactory::UploadImage(const LoadedImage& image, Texture& texture)
+{
+    //A lone uncompressed level gets a generated chain
+    if (!IsBlockCompressed(image.format) && image.levelOffsets.size() == 1) {
+        UploadTexture(image.data.data() + image.levelOffsets[0], image.width, image.height, texture, image.format);
+        return;
+    }
+    UploadCompressed(image, texture);
+}
+
+void KEngineVulkan::TextureFactory::UploadCompressed(const LoadedImage& image, Texture& texture)
+{
+    uint32_t mipLevels = static_cast<uint32_t>(image.levelOffsets.size());
+    size_t totalSize = 0;
+    for (uint32_t level = 0; level < mipLevels; level++) {
+        totalSize += LevelSize(image.format, std::max(image.width >> level, 1u), std::max(image.height >> level, 1u));
+    }
+
+    bool ownBatch = !mCore->inUploadBatch();
+    if (ownBatch) {
+        mCore->beginUploadBatch();
+    }
+
+    //Every level goes into one staging allocation, level sizes are whole blocks so each copy stays block aligned
+    VulkanCore::StagingAllocation staging = mCore->allocateStaging(totalSize);
+    mCore->createImage(image.width, image.height, image.format, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, texture.textureImage, texture.textureImageAllocation, mipLevels);
+    mCore->transitionImageLayout(texture.textureImage, image.format, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 0, mipLevels);
+    size_t stagingOffset = 0;
+    for (uint32_t level = 0; level < mipLevels; level++) {
+        uint32_t levelWidth = std::max(image.width >> level, 1u);
+        uint32_t levelHeight = std::max(image.height >> level, 1u);
+        size_t levelSize = LevelSize(image.format, levelWidth, levelHeight);
+        memcpy(static_cast<uint8_t*>(staging.data) + stagingOffset, image.data.data() + image.levelOffsets[level], levelSize);
+        mCore->copyBufferToImage(staging.buffer, texture.textureImage, levelWidth, levelHeight, staging.offset + stagingOffset, level);
+        stagingOffset += levelSize;
+    }
+    mCore->transitionImageLayout(texture.textureImage, image.format, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 0, mipLevels);
+    if (ownBatch) {
+        mCore->flushUploadBatch();
+    }
+
+    texture.textureImageView = mCore->createImageView(texture.textureImage, image.format, mipLevels);
+}
+
+void KEngineVulkan::TextureFactory::BeginAtlas(KEngineCore::StringHash atlasName, uint32_t pageSize, uint32_t padding)
+{
+    assert(mAtlases.find(atlasName) == mAtlases.end());
+    Atlas& atlas = mAtlases[atlasName];
+    atlas.pageSize = pageSize;
+    atlas.padding = padding;
+}
+
+void KEngineVulkan::TextureFactory::AddToAtlas(KEngineCore::StringHash atlasName, KEngineCore::StringHash name, const std::string& textureFilename)
+{
+    auto found = mAtlases.find(atlasName);
+    assert(found != mAtlases.end() && found->second.pages.empty()); // Begun and not yet built
+    Atlas& atlas = found->second;
+
     int texWidth, texHeight, texChannels;
     stbi_uc* pixels = stbi_load(textureFilename.c_str(), &texWidth, &texHeight, &texChannels, STBI_rgb_alpha);
-    VkDeviceSize imageSize = (int64_t)texWidth * (int64_t)texHeight * 4ll;
-
     if (!pixels) {
         throw std::runtime_error("failed to load texture image!");
     }
+    if ((uint32_t)texWidth + 2 * atlas.padding > atlas.pageSize || (uint32_t)texHeight + 2 * atlas.padding > atlas.pageSize) {
+        stbi_image_free(pixels);
+        throw std::runtime_error("texture image too large for atlas page!");
+    }
 
-    VkBuffer stagingBuffer;
-    VmaAllocation stagingBufferAllocation;
-    mCore->createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT, stagingBuffer, stagingBufferAllocation);
+    PendingImage image;
+    image.name = name;
+    image.width = texWidth;
+    image.height = texHeight;
+    image.pixels.assign(pixels, pixels + (size_t)texWidth * texHeight * 4);
+    stbi_image_free(pixels);
+    atlas.pending.push_back(std::move(image));
+}
 
-    void* data;
+void KEngineVulkan::TextureFactory::BuildAtlas(KEngineCore::StringHash atlasName)
+{
+    auto found = mAtlases.find(atlasName);
+    assert(found != mAtlases.end() && found->second.pages.empty());
+    Atlas& atlas = found->second;
+    uint32_t pageSize = atlas.pageSize;
+    uint32_t padding = atlas.padding;
 
-    vmaMapMemory(mCore->getAllocator(), stagingBufferAllocation, &data);
-    memcpy(data, pixels, static_cast<size_t>(imageSize));
-    vmaUnmapMemory(mCore->getAllocator(), stagingBufferAllocation);
+    //Tallest first keeps the skyline flat, which is what bottom-left packing does best with
+    std::sort(atlas.pending.begin(), atlas.pending.end(), [](const PendingImage& a, const PendingImage& b) {
+        return a.height != b.height ? a.height > b.height : a.width > b.width;
+    });
 
-    stbi_image_free(pixels);
+    std::vector<std::vector<uint8_t>> pagePixels;
+    std::vector<SkylinePacker> packers;
+    for (const PendingImage& image : atlas.pending) {
+        uint32_t cellWidth = image.width + 2 * padding;
+        uint32_t cellHeight = image.height + 2 * padding;
+        uint32_t x = 0, y = 0;
+        size_t page = 0;
+        while (page < packers.size() && !packers[page].Insert(cellWidth, cellHeight, x, y)) {
+            page++;
+        }
+        if (page == packers.size()) {
+            packers.emplace_back(pageSize, pageSize);
+            pagePixels.emplace_back((size_t)pageSize * pageSize * 4, (uint8_t)0);
+            atlas.stats.push_back({ pageSize, pageSize, 0, 0.0f });
+            bool inserted = packers.back().Insert(cellWidth, cellHeight, x, y);
+            assert(inserted); // Sizes were checked against the page in AddToAtlas
+            (void)inserted;
+        }
 
-    mCore->createImage(texWidth, texHeight, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, texture.textureImage, texture.textureImageAllocation);
+        //Copy the image into the middle of its cell, then extrude its edge pixels across the padding
+        uint8_t* target = pagePixels[page].data();
+        size_t pageStride = (size_t)pageSize * 4;
+        for (uint32_t row = 0; row < cellHeight; row++) {
+            uint32_t sourceRow = (uint32_t)std::min<int64_t>(std::max<int64_t>((int64_t)row - padding, 0), image.height - 1);
+            const uint8_t* source = image.pixels.data() + (size_t)sourceRow * image.width * 4;
+            uint8_t* destination = target + (size_t)(y + row) * pageStride + (size_t)x * 4;
+            for (uint32_t column = 0; column < padding; column++) {
+                memcpy(destination + column * 4, source, 4);
+                memcpy(destination + (padding + image.width + column) * 4, source + (image.width - 1) * 4, 4);
+            }
+            memcpy(destination + padding * 4, source, (size_t)image.width * 4);
+        }
 
-    //These three functions should combine their command buffers in practice
-    mCore->transitionImageLayout(texture.textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
-    mCore->copyBufferToImage(stagingBuffer, texture.textureImage, static_cast<uint32_t>(texWidth), static_cast<uint32_t>(texHeight));
-    mCore->transitionImageLayout(texture.textureImage, VK_FORMAT_R8G8B8A8_SRGB, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
-    vmaDestroyBuffer(mCore->getAllocator(), stagingBuffer, stagingBufferAllocation);
-  
-    texture.textureImageView = mCore->createImageView(texture.textureImage, VK_FORMAT_R8G8B8A8_SRGB);
+        AtlasRegion region;
+        region.pageView = VK_NULL_HANDLE; // Filled in once the page exists
+        region.page = static_cast<uint32_t>(page);
+        region.u0 = (float)(x + padding) / pageSize;
+        region.v0 = (float)(y + padding) / pageSize;
+        region.u1 = (float)(x + padding + image.width) / pageSize;
+        region.v1 = (float)(y + padding + image.height) / pageSize;
+        region.width = image.width;
+        region.height = image.height;
+        mAtlasRegions[image.name] = region;
 
+        atlas.stats[page].regionCount++;
+        atlas.stats[page].occupancy += (float)image.width * image.height / ((float)pageSize * pageSize);
+    }
 
-    mTextures[name] = texture;
+    //A texel of level n covers 2^n page texels, so below level log2(padding) it would average in the neighbouring regions
+    uint32_t mipLevels = 1;
+    while ((1u << mipLevels) <= padding) {
+        mipLevels++;
+    }
+    atlas.pages.resize(pagePixels.size());
+    for (size_t page = 0; page < pagePixels.size(); page++) {
+        UploadTexture(pagePixels[page].data(), pageSize, pageSize, atlas.pages[page], VK_FORMAT_R8G8B8A8_SRGB, mipLevels);
+    }
+    for (const PendingImage& image : atlas.pending) {
+        AtlasRegion& region = mAtlasRegions[image.name];
+        region.pageView = atlas.pages[region.page].textureImageView;
+        mTextures[image.name] = { VK_NULL_HANDLE, region.pageView, VK_NULL_HANDLE }; // Owned by the atlas, skipped by Deinit
+    }
+    atlas.pending.clear();
+    atlas.pending.shrink_to_fit();
+}
+
+const KEngineVulkan::TextureFactory::AtlasRegion& KEngineVulkan::TextureFactory::GetAtlasRegion(KEngineCore::StringHash name) const
+{
+    auto found = mAtlasRegions.find(name);
+    if (found == mAtlasRegions.end()) {
+        throw std::runtime_error("texture is not in a built atlas!");
+    }
+    return found->second;
+}
+
+std::vector<KEngineVulkan::TextureFactory::AtlasPageStats> KEngineVulkan::TextureFactory::GetAtlasStats(KEngineCore::StringHash atlasName) const
+{
+    auto found = mAtlases.find(atlasName);
+    if (found == mAtlases.end()) {
+        throw std::runtime_error("no atlas with that name!");
+    }
+    return found->second.stats;
+}
+
+KEngineVulkan::TextureFactory::SkylinePacker::SkylinePacker(uint32_t width, uint32_t height)
+{
+    mWidth = width;
+    mHeight = height;
+    mNodes.push_back({ 0, 0, width });
+}
+
+bool KEngineVulkan::TextureFactory::SkylinePacker::Fits(size_t nodeIndex, uint32_t width, uint32_t height, uint32_t& y) const
+{
+    //The rect rests on the highest node it spans
+    uint32_t x = mNodes[nodeIndex].x;
+    if (x + width > mWidth) {
+        return false;
+    }
+    y = 0;
+    uint32_t remaining = width;
+    for (size_t i = nodeIndex; remaining > 0; i++) {
+        if (i == mNodes.size()) {
+            return false;
+        }
+        y = std::max(y, mNodes[i].y);
+        if (y + height > mHeight) {
+            return false;
+        }
+        remaining -= std::min(remaining, mNodes[i].width);
+    }
+    return true;
+}
+
+bool KEngineVulkan::TextureFactory::SkylinePacker::Insert(uint32_t width, uint32_t height, uint32_t& x, uint32_t& y)
+{
+    //Bottom-left: lowest resting place, ties to the narrowest node so wide gaps stay open
+    size_t bestIndex = mNodes.size();
+    uint32_t bestY = UINT32_MAX;
+    uint32_t bestWidth = UINT32_MAX;
+    for (size_t i = 0; i < mNodes.size(); i++) {
+        uint32_t fitY;
+        if (Fits(i, width, height, fitY) && (fitY + height < bestY || (fitY + height == bestY && mNodes[i].width < bestWidth))) {
+            bestIndex = i;
+            bestY = fitY + height;
+            bestWidth = mNodes[i].width;
+        }
+    }
+    if (bestIndex == mNodes.size()) {
+        return false;
+    }
+
+    x = mNodes[bestIndex].x;
+    y = bestY - height;
+    mNodes.insert(mNodes.begin() + bestIndex, { x, bestY, width });
+
+    //Trim or drop the nodes now under the new one
+    for (size_t i = bestIndex + 1; i < mNodes.size();) {
+        uint32_t newEnd = mNodes[bestIndex].x + mNodes[bestIndex].width;
+        if (mNodes[i].x >= newEnd) {
+            break;
+        }
+        uint32_t overlap = newEnd - mNodes[i].x;
+        if (overlap >= mNodes[i].width) {
+            mNodes.erase(mNodes.begin() + i);
+        }
+        else {
+            mNodes[i].x += overlap;
+            mNodes[i].width -= overlap;
+            break;
+        }
+    }
+
+    //Merge neighbours at the same height
+    for (size_t i = 0; i + 1 < mNodes.size();) {
+        if (mNodes[i].y == mNodes[i + 1].y) {
+            mNodes[i].width += mNodes[i + 1].width;
+            mNodes.erase(mNodes.begin() + i + 1);
+        }
+        else {
+            i++;
+        }
+    }
+    return true;
 }
 
 VkImageView KEngineVulkan::TextureFactory::GetTexture(KEngineCore::StringHash name) const
 {
-    return mTextures.find(name)->second.textureImageView;
+    auto found = mTextures.find(name);
+    if (found != mTextures.end()) {
+        return found->second.textureImageView;
+    }
+    auto streaming = mStreamingNames.find(name);
+    if (streaming != mStreamingNames.end()) {
+        return mStreamingTextures[streaming->second].view;
+    }
+    return mPlaceholder.textureImageView;
 }
\ No newline at end of file
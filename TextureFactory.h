@@ -10,6 +10,12 @@
 #pragma once
 #include <string>
 #include <map>
+#include <vector>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#include <cstdint>
 #include <vulkan/vulkan.h>
 #include "vk_mem_alloc.h"
 #include "StringHash.h"
@@ -17,14 +23,82 @@
 namespace KEngineVulkan {
 	class VulkanCore;
 
+	//Names a streamed texture, stays valid until the factory is deinitialized
+	struct TextureHandle
+	{
+		uint32_t index{ UINT32_MAX };
+		bool IsValid() const { return index != UINT32_MAX; }
+	};
+
 	class TextureFactory
 	{
 	public:
 		~TextureFactory() { Deinit(); }
 		void Init(VulkanCore * core);
+		//.ktx2 and .dds files upload their BC/ETC2 blocks and stored mip levels as is. If the device can't sample the format, level 0
+		//is decoded on the CPU (BC1, BC3, ETC2 and EAC alpha) and uploaded like any other image
 		void CreateTexture(KEngineCore::StringHash name, const std::string& textureFilename);
-		VkImageView GetTexture(KEngineCore::StringHash name) const;
-		void Deinit();
+		VkImageView GetTexture(KEngineCore::StringHash name) const; // Unknown names get the placeholder texture
+
+		//Streaming: LoadTextureAsync returns straight away with a handle that resolves to a shared placeholder until the file is
+		//decoded on the worker threads, uploaded, and its upload batch has completed. UpdateStreaming does the uploading and
+		//swapping, call it once per frame outside the render pass. Sprites holding a handle rewrite their descriptors themselves.
+		enum class TextureState { Loading, Ready, Failed, Evicted };
+		TextureHandle LoadTextureAsync(KEngineCore::StringHash name, const std::string& textureFilename);
+		TextureHandle GetTextureHandle(KEngineCore::StringHash name) const; // Invalid for names never loaded asynchronously
+		VkImageView GetTexture(TextureHandle handle) const; // Counts as a use for eviction, and brings an evicted texture back
+		uint64_t GetTextureVersion(TextureHandle handle) const; // Changes whenever the handle's view does, never repeats
+		TextureState GetTextureState(TextureHandle handle) const;
+		void UpdateStreaming();
+
+		//Residency: streamed textures unused for longer than the frames in flight are evicted least recently used first while
+		//over budget, falling back to the placeholder until something resolves their handle again and they stream back in.
+		//Textures from CreateTexture and atlases are never evicted, callers may hold their views directly.
+		struct ResidencyStats
+		{
+			VkDeviceSize residentBytes; // Streamed textures only
+			uint64_t evictions;
+			uint64_t reloads;
+		};
+		void SetResidencyBudget(VkDeviceSize bytes); // 0, the default, keeps device local heaps under 90% of VMA's heap budget
+		const ResidencyStats& GetResidencyStats() const;
+
+		//Batch loading: files are decoded on the worker threads while the calling thread uploads whatever has finished,
+		//submitting the upload batch whenever it runs out of decoded images so the GPU copies overlap the remaining decodes.
+		//Joins the caller's upload batch instead if one is open. Timings come back in request order.
+		struct TextureLoadTiming
+		{
+			KEngineCore::StringHash name;
+			double decodeSeconds; // On a worker thread, file read included
+			double uploadSeconds; // Staging copy and command recording on the calling thread
+		};
+		std::vector<TextureLoadTiming> CreateTextures(const std::vector<std::pair<KEngineCore::StringHash, std::string>>& textures);
+		void Deinit(); // Waits for decodes still on the core's worker pool
+
+		//Atlas mode: images added to an atlas are packed into shared pages by BuildAtlas, so sprites drawn from one page share
+		//a texture and can batch. Each image is surrounded by padding filled with its own edge pixels so filtering does not bleed.
+		//After BuildAtlas, GetTexture on an image name returns its page's view, and GetAtlasRegion gives the UV rect to draw with,
+		//e.g. through SpriteGraphic::SetUVRect. Both lookups throw for names that were never atlased.
+		//Pages only get log2(padding) + 1 mip levels, as far down as the padding keeps neighbours apart.
+		struct AtlasRegion
+		{
+			VkImageView pageView;
+			uint32_t page;
+			float u0, v0, u1, v1;
+			uint32_t width, height;
+		};
+		struct AtlasPageStats
+		{
+			uint32_t width;
+			uint32_t height;
+			uint32_t regionCount;
+			float occupancy; // Fraction of the page covered by image pixels, padding excluded
+		};
+		void BeginAtlas(KEngineCore::StringHash atlasName, uint32_t pageSize = 2048, uint32_t padding = 2);
+		void AddToAtlas(KEngineCore::StringHash atlasName, KEngineCore::StringHash name, const std::string& textureFilename);
+		void BuildAtlas(KEngineCore::StringHash atlasName);
+		const AtlasRegion& GetAtlasRegion(KEngineCore::StringHash name) const;
+		std::vector<AtlasPageStats> GetAtlasStats(KEngineCore::StringHash atlasName) const;
 	private:
 
 		struct Texture
@@ -34,7 +108,110 @@ namespace KEngineVulkan {
 			VmaAllocation textureImageAllocation;
 		};
 
+		//Bottom-left skyline packer, the skyline is the top edge of everything placed so far
+		class SkylinePacker
+		{
+		public:
+			SkylinePacker(uint32_t width, uint32_t height);
+			bool Insert(uint32_t width, uint32_t height, uint32_t& x, uint32_t& y);
+		private:
+			struct Node
+			{
+				uint32_t x;
+				uint32_t y;
+				uint32_t width;
+			};
+			bool Fits(size_t nodeIndex, uint32_t width, uint32_t height, uint32_t& y) const;
+			uint32_t mWidth;
+			uint32_t mHeight;
+			std::vector<Node> mNodes;
+		};
+
+		struct PendingImage
+		{
+			KEngineCore::StringHash name;
+			int width;
+			int height;
+			std::vector<uint8_t> pixels;
+		};
+		struct Atlas
+		{
+			uint32_t pageSize;
+			uint32_t padding;
+			std::vector<PendingImage> pending;
+			std::vector<Texture> pages;
+			std::vector<AtlasPageStats> stats;
+		};
+
+		//Uploads level 0 and fills in a full mip chain, blitted on the GPU or box filtered on the CPU when the format can't be blitted
+		void UploadTexture(const uint8_t* pixels, uint32_t width, uint32_t height, Texture& texture, VkFormat format = VK_FORMAT_R8G8B8A8_SRGB, uint32_t maxMipLevels = UINT32_MAX);
+		static void Downsample(const uint8_t* source, uint32_t width, uint32_t height, uint8_t* destination, bool srgb);
+
+		//A decoded file, either RGBA8 pixels or blocks and mip levels read straight from a container
+		struct LoadedImage
+		{
+			VkFormat format;
+			uint32_t width;
+			uint32_t height;
+			std::vector<size_t> levelOffsets; // Into data, largest level first
+			std::vector<uint8_t> data;
+		};
+		static LoadedImage LoadKTX2(std::vector<uint8_t>&& file);
+		static LoadedImage LoadDDS(std::vector<uint8_t>&& file);
+		LoadedImage DecodeTexture(const std::string& textureFilename) const; // Safe on any thread
+		void UploadImage(const LoadedImage& image, Texture& texture);
+		void UploadCompressed(const LoadedImage& image, Texture& texture);
+
+		struct StreamingTexture
+		{
+			KEngineCore::StringHash name;
+			std::string filename; // Empty when the name was already loaded, which keeps it resident
+			TextureState state;
+			VkImageView view; // The placeholder unless Ready
+			uint64_t version;
+			VkDeviceSize bytes;
+			uint64_t evictedFrame;
+			mutable uint64_t lastUsedFrame;
+		};
+		struct StreamingDecode
+		{
+			uint32_t index;
+			LoadedImage image;
+			bool failed;
+		};
+		struct StreamingUpload
+		{
+			uint32_t index;
+			Texture texture;
+			uint64_t token; // VulkanCore::UploadToken, swapped in once it completes
+		};
+
+		void QueueStreamingDecode(uint32_t index, const std::string& textureFilename);
+		bool OverResidencyBudget() const;
+		void EnforceResidencyBudget();
+		void EvictTexture(uint32_t index);
+
+		void QueueDecode(std::function<void()> job); // On the core's worker pool
+		void WaitForDecodes();
+
 		VulkanCore* mCore;
 		std::map<KEngineCore::StringHash, Texture> mTextures;
+		std::map<KEngineCore::StringHash, Atlas> mAtlases;
+		std::map<KEngineCore::StringHash, AtlasRegion> mAtlasRegions;
+
+		Texture mPlaceholder{ VK_NULL_HANDLE, VK_NULL_HANDLE, VK_NULL_HANDLE };
+		std::vector<StreamingTexture> mStreamingTextures;
+		std::map<KEngineCore::StringHash, uint32_t> mStreamingNames;
+		std::vector<StreamingUpload> mStreamingUploads;
+		std::vector<StreamingDecode> mStreamingDecoded; // Filled by the decode jobs
+		std::mutex mStreamingMutex;
+		uint64_t mStreamingFrame = 0; // Counts UpdateStreaming calls
+		uint64_t mNextTextureVersion = 1;
+		VkDeviceSize mResidencyBudget = 0;
+		ResidencyStats mResidencyStats{};
+
+		uint32_t mPendingDecodes = 0;
+		std::mutex mDecodeMutex;
+		std::condition_variable mDecodeCondition;
 	};
 }
@@ -6,8 +6,10 @@
 #include <array>
 #include <set>
 #include <limits> 
+#include <cstring>
 #include <assert.h>
 
+#if defined(_WIN32) || defined(_WINDOWS)
 void KEngineVulkan::VulkanCore::Init(const std::string& applicationName, HWND hwnd, HINSTANCE hinstance)
 {
 #ifndef NDEBUG
@@ -27,11 +29,44 @@ void KEngineVulkan::VulkanCore::Init(const std::string& applicationName, HWND hw
     createRenderPass();
     createFramebuffers();
     createCommandPool();
+    createStagingRing();
+    createCommandBuffers();
+    createDescriptorPool(1000);
+    createViewDescriptorSetLayout();
     createCommandBuffers();
+    createSyncObjects();
+    createFrameUniformArenas();
+    createTextureSamplers();
+    workerPool.Start(0);
+}
+#endif
+
+void KEngineVulkan::VulkanCore::InitHeadless(const std::string& applicationName, int width, int height)
+{
+#ifndef NDEBUG
+    enableValidationLayers = true;
+#endif
+    headless = true;
+    surface = VK_NULL_HANDLE;
+    swapChain = VK_NULL_HANDLE;
+    createInstance(applicationName);
+    pickPhysicalDevice();
+    createLogicalDevice();
+    createAllocator();
+    createOffscreenImages(width, height);
+    createSwapChainImageViews();
+    createRenderPass();
+    createFramebuffers();
+    createCommandPool();
+    createStagingRing();
     createDescriptorPool(1000);
+    createViewDescriptorSetLayout();
     createCommandBuffers();
     createSyncObjects();
+    createFrameUniformArenas();
+    createReadbackBuffers();
     createTextureSamplers();
+    workerPool.Start(0);
 }
 
 void KEngineVulkan::VulkanCore::createInstance(const std::string& applicationName) {
@@ -128,10 +163,15 @@ KEngineVulkan::VulkanCore::QueueFamilyIndices KEngineVulkan::VulkanCore::findQue
             indices.graphicsFamily = i;
         }
 
-        VkBool32 presentSupport = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
-        if (presentSupport) {
-            indices.presentFamily = i;
+        if (headless) {
+            indices.presentFamily = indices.graphicsFamily; // Nothing is presented, keeps the queue setup uniform
+        }
+        else {
+            VkBool32 presentSupport = false;
+            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentSupport);
+            if (presentSupport) {
+                indices.presentFamily = i;
+            }
         }
         if (indices.isComplete()) {
             break;
@@ -139,6 +179,16 @@ KEngineVulkan::VulkanCore::QueueFamilyIndices KEngineVulkan::VulkanCore::findQue
         i++;
     }
 
+    //Prefer a transfer-only family, then an async compute one, either can copy while graphics keeps rendering
+    for (uint32_t family = 0; family < queueFamilyCount; family++) {
+        VkQueueFlags flags = queueFamilies[family].queueFlags;
+        if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT)) {
+            if (!indices.transferFamily.has_value() || !(flags & VK_QUEUE_COMPUTE_BIT)) {
+                indices.transferFamily = family;
+            }
+        }
+    }
+
     return indices;
 }
 
@@ -148,11 +198,19 @@ void KEngineVulkan::VulkanCore::createLogicalDevice()
 
     VkDeviceCreateInfo createInfo{};
     deviceFeatures.samplerAnisotropy = VK_TRUE;
+
+    //Block compressed formats only report as sampleable when their feature is there, and using them needs it enabled
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+    deviceFeatures.textureCompressionBC = supportedFeatures.textureCompressionBC;
+    deviceFeatures.textureCompressionETC2 = supportedFeatures.textureCompressionETC2;
     createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
     QueueFamilyIndices indices = findQueueFamilies(physicalDevice);
 
     std::vector<VkDeviceQueueCreateInfo> queueCreateInfos;
-    std::set<uint32_t> uniqueQueueFamilies = { indices.graphicsFamily.value(), indices.presentFamily.value() };
+    graphicsQueueFamily = indices.graphicsFamily.value();
+    transferQueueFamily = indices.transferFamily.value_or(graphicsQueueFamily);
+    std::set<uint32_t> uniqueQueueFamilies = { indices.graphicsFamily.value(), indices.presentFamily.value(), transferQueueFamily };
 
     float queuePriority = 1.0f;
     for (uint32_t queueFamily : uniqueQueueFamilies) {
@@ -170,8 +228,23 @@ void KEngineVulkan::VulkanCore::createLogicalDevice()
 
     createInfo.pEnabledFeatures = &deviceFeatures;
 
-    createInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensions.size());
-    createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+    auto extensions = getRequiredDeviceExtensions();
+    uint32_t extensionCount;
+    vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, nullptr);
+    std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+    vkEnumerateDeviceExtensionProperties(physicalDevice, nullptr, &extensionCount, availableExtensions.data());
+    for (const auto& extension : availableExtensions) {
+        if (strcmp(extension.extensionName, VK_EXT_MEMORY_BUDGET_EXTENSION_NAME) == 0) {
+            extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+            memoryBudgetExtension = true;
+        }
+        if (strcmp(extension.extensionName, VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME) == 0) {
+            extensions.push_back(VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME);
+            pipelineCreationFeedbackExtension = true;
+        }
+    }
+    createInfo.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+    createInfo.ppEnabledExtensionNames = extensions.data();
 
     //Validation layers set here may be ignored, good idea to set them anyway.
     if (enableValidationLayers) {
@@ -189,6 +262,7 @@ void KEngineVulkan::VulkanCore::createLogicalDevice()
 
     vkGetDeviceQueue(device, indices.graphicsFamily.value(), 0, &graphicsQueue);
     vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
+    vkGetDeviceQueue(device, transferQueueFamily, 0, &transferQueue);
 }
 
 void KEngineVulkan::VulkanCore::createAllocator()
@@ -198,6 +272,9 @@ void KEngineVulkan::VulkanCore::createAllocator()
     allocatorCreateInfo.physicalDevice = physicalDevice;
     allocatorCreateInfo.device = device;
     allocatorCreateInfo.instance = instance;
+    if (memoryBudgetExtension) {
+        allocatorCreateInfo.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
+    }
 
     if (vmaCreateAllocator(&allocatorCreateInfo, &allocator) != VK_SUCCESS) {
         throw std::runtime_error("failed to create allocator!");
@@ -321,6 +398,72 @@ void KEngineVulkan::VulkanCore::createSwapChain(int width, int height)
     swapChainExtent = extent;
 }
 
+void KEngineVulkan::VulkanCore::createOffscreenImages(int width, int height)
+{
+    swapChainImageFormat = VK_FORMAT_R8G8B8A8_SRGB;
+    swapChainExtent = { static_cast<uint32_t>(width), static_cast<uint32_t>(height) };
+
+    //One target per frame in flight, so a frame can be rendered while the previous one is still being read back
+    swapChainImages.resize(MAX_FRAMES_IN_FLIGHT);
+    offscreenImageAllocations.resize(MAX_FRAMES_IN_FLIGHT);
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        createImage(swapChainExtent.width, swapChainExtent.height, swapChainImageFormat, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, swapChainImages[i], offscreenImageAllocations[i]);
+    }
+}
+
+void KEngineVulkan::VulkanCore::createReadbackBuffers()
+{
+    VkDeviceSize bufferSize = (VkDeviceSize)swapChainExtent.width * swapChainExtent.height * 4;
+    readbackBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+    readbackMappings.resize(MAX_FRAMES_IN_FLIGHT);
+    pendingReadbacks.clear();
+    pendingReadbacks.resize(MAX_FRAMES_IN_FLIGHT);
+
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT, (VmaAllocationCreateFlagBits)(VMA_ALLOCATION_CREATE_HOST_ACCESS_RANDOM_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT), readbackBuffers[i].first, readbackBuffers[i].second);
+        VmaAllocationInfo allocationInfo;
+        vmaGetAllocationInfo(allocator, readbackBuffers[i].second, &allocationInfo);
+        readbackMappings[i] = allocationInfo.pMappedData;
+    }
+}
+
+void KEngineVulkan::VulkanCore::deliverReadback(int frame)
+{
+    if (!pendingReadbacks[frame].has_value()) {
+        return;
+    }
+    uint64_t readbackFrameNumber = pendingReadbacks[frame].value();
+    pendingReadbacks[frame].reset();
+    if (readbackCallback) {
+        vmaInvalidateAllocation(allocator, readbackBuffers[frame].second, 0, VK_WHOLE_SIZE);
+        readbackCallback(readbackFrameNumber, readbackMappings[frame], swapChainExtent.width, swapChainExtent.height, swapChainExtent.width * 4);
+    }
+}
+
+void KEngineVulkan::VulkanCore::setReadbackCallback(ReadbackCallback callback)
+{
+    readbackCallback = callback;
+}
+
+void KEngineVulkan::VulkanCore::flushReadbacks()
+{
+    assert(headless);
+    assert(!mInRenderPass);
+    //Oldest first, currentFrame is the next slot to be reused and therefore holds the oldest submission
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        int frame = (currentFrame + i) % MAX_FRAMES_IN_FLIGHT;
+        if (pendingReadbacks[frame].has_value()) {
+            vkWaitForFences(device, 1, &inFlightFences[frame], VK_TRUE, UINT64_MAX);
+            deliverReadback(frame);
+        }
+    }
+}
+
+bool KEngineVulkan::VulkanCore::isHeadless() const
+{
+    return headless;
+}
+
 void KEngineVulkan::VulkanCore::createSwapChainImageViews()
 {
     swapChainImageViews.resize(swapChainImages.size());
@@ -340,7 +483,7 @@ void KEngineVulkan::VulkanCore::createRenderPass()
     colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    colorAttachment.finalLayout = headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
 
     VkAttachmentReference colorAttachmentRef{};
     colorAttachmentRef.attachment = 0;
@@ -369,8 +512,18 @@ void KEngineVulkan::VulkanCore::createRenderPass()
     dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
     dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
 
-    renderPassInfo.dependencyCount = 1;
-    renderPassInfo.pDependencies = &dependency;
+    //Headless frames are copied out right after the pass, so the copy has to wait for the color writes
+    VkSubpassDependency readbackDependency{};
+    readbackDependency.srcSubpass = 0;
+    readbackDependency.dstSubpass = VK_SUBPASS_EXTERNAL;
+    readbackDependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+    readbackDependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    readbackDependency.dstStageMask = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    readbackDependency.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+
+    std::array<VkSubpassDependency, 2> dependencies = { dependency, readbackDependency };
+    renderPassInfo.dependencyCount = headless ? 2 : 1;
+    renderPassInfo.pDependencies = dependencies.data();
 
     if (vkCreateRenderPass(device, &renderPassInfo, nullptr, &renderPass) != VK_SUCCESS) {
         throw std::runtime_error("failed to create render pass!");
@@ -413,27 +566,103 @@ void KEngineVulkan::VulkanCore::createCommandPool()
     if (vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool) != VK_SUCCESS) {
         throw std::runtime_error("failed to create command pool!");
     }
+
+    transferCommandPool = commandPool;
+    if (hasDedicatedTransferQueue()) {
+        poolInfo.queueFamilyIndex = transferQueueFamily;
+        if (vkCreateCommandPool(device, &poolInfo, nullptr, &transferCommandPool) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create transfer command pool!");
+        }
+    }
+}
+
+void KEngineVulkan::VulkanCore::createStagingRing()
+{
+    createBuffer(STAGING_RING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, (VmaAllocationCreateFlagBits)(VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT), stagingRing.first, stagingRing.second);
+    VmaAllocationInfo allocationInfo;
+    vmaGetAllocationInfo(allocator, stagingRing.second, &allocationInfo);
+    stagingRingData = static_cast<uint8_t*>(allocationInfo.pMappedData);
+    stagingHead = 0;
+    stagingTail = 0;
+    stagingRegions.clear();
+    stagingStats = StagingStats();
+    stagingStats.capacity = STAGING_RING_SIZE;
+}
+
+void KEngineVulkan::VulkanCore::createFrameUniformArenas()
+{
+    VkPhysicalDeviceProperties properties{};
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    uniformOffsetAlignment = properties.limits.minUniformBufferOffsetAlignment;
+
+    frameUniformArenas.assign(MAX_FRAMES_IN_FLIGHT, { VK_NULL_HANDLE, VK_NULL_HANDLE });
+    frameUniformData.resize(MAX_FRAMES_IN_FLIGHT);
+    frameUniformSizes.assign(MAX_FRAMES_IN_FLIGHT, 0);
+    frameUniformGenerations.assign(MAX_FRAMES_IN_FLIGHT, 0);
+    retiredFrameUniformArenas.resize(MAX_FRAMES_IN_FLIGHT);
+    frameUniformHead = 0;
+    frameUniformRetiredBytes = 0;
+    frameUniformStats = FrameUniformStats();
+    frameUniformStats.arenaSize = FRAME_UNIFORM_ARENA_INITIAL_SIZE;
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        createFrameUniformArena(i, FRAME_UNIFORM_ARENA_INITIAL_SIZE);
+    }
+}
+
+void KEngineVulkan::VulkanCore::createFrameUniformArena(int frame, VkDeviceSize size)
+{
+    if (frameUniformArenas[frame].first != VK_NULL_HANDLE) {
+        retiredFrameUniformArenas[frame].push_back(frameUniformArenas[frame]);
+    }
+    createBuffer(size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, (VmaAllocationCreateFlagBits)(VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT), frameUniformArenas[frame].first, frameUniformArenas[frame].second);
+    VmaAllocationInfo allocationInfo;
+    vmaGetAllocationInfo(allocator, frameUniformArenas[frame].second, &allocationInfo);
+    frameUniformData[frame] = static_cast<uint8_t*>(allocationInfo.pMappedData);
+    frameUniformSizes[frame] = size;
+    frameUniformGenerations[frame]++;
 }
 
 void KEngineVulkan::VulkanCore::createDescriptorPool(int size)
 {
-    std::array<VkDescriptorPoolSize, 2> poolSizes{};
+    std::array<VkDescriptorPoolSize, 3> poolSizes{};
     poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
     poolSizes[0].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT * size);
     poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
     poolSizes[1].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT * size);
+    poolSizes[2].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    poolSizes[2].descriptorCount = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT * size);
 
     VkDescriptorPoolCreateInfo poolInfo{};
     poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
     poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
     poolInfo.pPoolSizes = poolSizes.data();
     poolInfo.maxSets = static_cast<uint32_t>(MAX_FRAMES_IN_FLIGHT) * size;
+    poolInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT; // Graphics free their sets on Deinit
 
     if (vkCreateDescriptorPool(device, &poolInfo, nullptr, &descriptorPool) != VK_SUCCESS) {
         throw std::runtime_error("failed to create descriptor pool!");
     }
 }
 
+void KEngineVulkan::VulkanCore::createViewDescriptorSetLayout()
+{
+    VkDescriptorSetLayoutBinding viewBinding{};
+    viewBinding.binding = 0;
+    viewBinding.descriptorCount = 1;
+    viewBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    viewBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+    viewBinding.pImmutableSamplers = nullptr;
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = 1;
+    layoutInfo.pBindings = &viewBinding;
+
+    if (vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &viewDescriptorSetLayout) != VK_SUCCESS) {
+        throw std::runtime_error("failed to create view descriptor set layout!");
+    }
+}
+
 void KEngineVulkan::VulkanCore::createCommandBuffers()
 {
     commandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
@@ -446,6 +675,11 @@ void KEngineVulkan::VulkanCore::createCommandBuffers()
     if (vkAllocateCommandBuffers(device, &allocInfo, commandBuffers.data()) != VK_SUCCESS) {
         throw std::runtime_error("failed to allocate command buffers!");
     }
+
+    acquireCommandBuffers.resize(MAX_FRAMES_IN_FLIGHT);
+    if (vkAllocateCommandBuffers(device, &allocInfo, acquireCommandBuffers.data()) != VK_SUCCESS) {
+        throw std::runtime_error("failed to allocate command buffers!");
+    }
 }
 
 void KEngineVulkan::VulkanCore::createSyncObjects()
@@ -453,6 +687,7 @@ void KEngineVulkan::VulkanCore::createSyncObjects()
     imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
     renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
     inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+    frameUploadSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
 
     VkSemaphoreCreateInfo semaphoreInfo{};
     semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
@@ -495,7 +730,7 @@ void KEngineVulkan::VulkanCore::createTextureSamplers()
     samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
     samplerInfo.mipLodBias = 0.0f;
     samplerInfo.minLod = 0.0f;
-    samplerInfo.maxLod = 0.0f;
+    samplerInfo.maxLod = VK_LOD_CLAMP_NONE; // Clamped by each view's level count
     textureSamplers.clear();
     textureSamplers.resize(2);
     if (vkCreateSampler(device, &samplerInfo, nullptr, &textureSamplers[0]) != VK_SUCCESS) {
@@ -517,6 +752,16 @@ VkDevice KEngineVulkan::VulkanCore::getDevice() const
     return device;
 }
 
+VkPhysicalDevice KEngineVulkan::VulkanCore::getPhysicalDevice() const
+{
+    return physicalDevice;
+}
+
+bool KEngineVulkan::VulkanCore::hasPipelineCreationFeedback() const
+{
+    return pipelineCreationFeedbackExtension;
+}
+
 VmaAllocator KEngineVulkan::VulkanCore::getAllocator() const
 {
     return allocator;
@@ -553,14 +798,14 @@ void KEngineVulkan::VulkanCore::createBuffer(VkDeviceSize size, VkBufferUsageFla
     }
 }
 
-void KEngineVulkan::VulkanCore::createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkImage & image, VmaAllocation & imageAllocation) {
+void KEngineVulkan::VulkanCore::createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkImage & image, VmaAllocation & imageAllocation, uint32_t mipLevels) {
     VkImageCreateInfo imageInfo{};
     imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     imageInfo.imageType = VK_IMAGE_TYPE_2D;
     imageInfo.extent.width = width;
     imageInfo.extent.height = height;
     imageInfo.extent.depth = 1;
-    imageInfo.mipLevels = 1;
+    imageInfo.mipLevels = mipLevels;
     imageInfo.arrayLayers = 1;
     imageInfo.format = format;
     imageInfo.tiling = tiling;
@@ -578,7 +823,7 @@ void KEngineVulkan::VulkanCore::createImage(uint32_t width, uint32_t height, VkF
     }
 }
 
-void KEngineVulkan::VulkanCore::transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout) {
+void KEngineVulkan::VulkanCore::transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t baseMipLevel, uint32_t levelCount) {
     VkCommandBuffer commandBuffer = beginSingleTimeCommands();
     VkImageMemoryBarrier barrier{}; //Barrier can be used to change layouts OR queue families or just for synchronization
     barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
@@ -588,8 +833,8 @@ void KEngineVulkan::VulkanCore::transitionImageLayout(VkImage image, VkFormat fo
     barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
     barrier.image = image;
     barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    barrier.subresourceRange.baseMipLevel = 0;
-    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.baseMipLevel = baseMipLevel;
+    barrier.subresourceRange.levelCount = levelCount;
     barrier.subresourceRange.baseArrayLayer = 0;
     barrier.subresourceRange.layerCount = 1;
 
@@ -603,6 +848,21 @@ void KEngineVulkan::VulkanCore::transitionImageLayout(VkImage image, VkFormat fo
         sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
         destinationStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
     }
+    else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL && hasDedicatedTransferQueue()) {
+        //Release to the graphics queue, the matching acquire is recorded at the start of the next frame
+        barrier.srcQueueFamilyIndex = transferQueueFamily;
+        barrier.dstQueueFamilyIndex = graphicsQueueFamily;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = 0;
+
+        sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+        destinationStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+
+        VkImageMemoryBarrier acquire = barrier;
+        acquire.srcAccessMask = 0;
+        acquire.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        currentUploadBatch->imageAcquires.push_back(acquire);
+    }
     else if (oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL && newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) {
         barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
         barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
@@ -625,15 +885,15 @@ void KEngineVulkan::VulkanCore::transitionImageLayout(VkImage image, VkFormat fo
     endSingleTimeCommands(commandBuffer);
 }
 
-void KEngineVulkan::VulkanCore::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height) {
+void KEngineVulkan::VulkanCore::copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height, VkDeviceSize bufferOffset, uint32_t mipLevel) {
     VkCommandBuffer commandBuffer = beginSingleTimeCommands();
     VkBufferImageCopy region{};
-    region.bufferOffset = 0;
+    region.bufferOffset = bufferOffset;
     region.bufferRowLength = 0;
     region.bufferImageHeight = 0;
 
     region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.mipLevel = mipLevel;
     region.imageSubresource.baseArrayLayer = 0;
     region.imageSubresource.layerCount = 1;
 
@@ -656,13 +916,32 @@ void KEngineVulkan::VulkanCore::copyBufferToImage(VkBuffer buffer, VkImage image
     endSingleTimeCommands(commandBuffer);
 }
 
-void KEngineVulkan::VulkanCore::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
+void KEngineVulkan::VulkanCore::copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size, VkDeviceSize srcOffset) {
     VkCommandBuffer commandBuffer = beginSingleTimeCommands();
 
     VkBufferCopy copyRegion{};
+    copyRegion.srcOffset = srcOffset;
     copyRegion.size = size;
     vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
 
+    if (hasDedicatedTransferQueue()) {
+        VkBufferMemoryBarrier release{};
+        release.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        release.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        release.dstAccessMask = 0;
+        release.srcQueueFamilyIndex = transferQueueFamily;
+        release.dstQueueFamilyIndex = graphicsQueueFamily;
+        release.buffer = dstBuffer;
+        release.offset = 0;
+        release.size = size;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 1, &release, 0, nullptr);
+
+        VkBufferMemoryBarrier acquire = release;
+        acquire.srcAccessMask = 0;
+        acquire.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT;
+        currentUploadBatch->bufferAcquires.push_back(acquire);
+    }
+
     endSingleTimeCommands(commandBuffer);
 }
 
@@ -683,6 +962,9 @@ int KEngineVulkan::VulkanCore::getCurrentFrame() const
 
 VkCommandBuffer KEngineVulkan::VulkanCore::getCommandBuffer() const
 {
+    if (inlineSecondary != VK_NULL_HANDLE) {
+        return inlineSecondary;
+    }
     return commandBuffers[currentFrame];
 }
 
@@ -691,45 +973,517 @@ VkDescriptorPool KEngineVulkan::VulkanCore::getDescriptorPool() const
     return descriptorPool;
 }
 
+VkDescriptorSetLayout KEngineVulkan::VulkanCore::getViewDescriptorSetLayout() const
+{
+    return viewDescriptorSetLayout;
+}
+
 void KEngineVulkan::VulkanCore::uploadIndexBuffer(const uint16_t* indices, size_t size, VkBuffer& indexBuffer, VmaAllocation& indexBufferAllocation)
 {
     VkDeviceSize bufferSize = sizeof(uint16_t) * size;
 
-    VkBuffer stagingBuffer;
-    VmaAllocation stagingBufferAllocation;
-    createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT, stagingBuffer, stagingBufferAllocation);
-
-    void* data;
+    bool ownBatch = !inUploadBatch();
+    if (ownBatch) {
+        beginUploadBatch();
+    }
 
-    vmaMapMemory(allocator, stagingBufferAllocation, &data);
-    memcpy(data, indices, (size_t)bufferSize);
-    vmaUnmapMemory(allocator, stagingBufferAllocation);
+    StagingAllocation staging = allocateStaging(bufferSize);
+    memcpy(staging.data, indices, (size_t)bufferSize);
 
     createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, (VmaAllocationCreateFlagBits)0, indexBuffer, indexBufferAllocation);
 
-    copyBuffer(stagingBuffer, indexBuffer, bufferSize);
+    copyBuffer(staging.buffer, indexBuffer, bufferSize, staging.offset);
+    if (ownBatch) {
+        flushUploadBatch();
+    }
+}
+
+void KEngineVulkan::VulkanCore::beginUploadBatch()
+{
+    assert(!currentUploadBatch.has_value());
+    collectUploadBatches();
+
+    UploadBatch batch;
+    if (!freeUploadBatches.empty()) {
+        batch = std::move(freeUploadBatches.back());
+        freeUploadBatches.pop_back();
+    }
+    else {
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        allocInfo.commandPool = transferCommandPool;
+        allocInfo.commandBufferCount = 1;
+
+        VkFenceCreateInfo fenceInfo{};
+        fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+        if (vkAllocateCommandBuffers(device, &allocInfo, &batch.commandBuffer) != VK_SUCCESS ||
+            vkCreateFence(device, &fenceInfo, nullptr, &batch.fence) != VK_SUCCESS) {
+            throw std::runtime_error("failed to create upload batch!");
+        }
+    }
+    batch.token = nextUploadToken++;
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    if (vkBeginCommandBuffer(batch.commandBuffer, &beginInfo) != VK_SUCCESS) {
+        throw std::runtime_error("failed to begin recording upload batch!");
+    }
+    currentUploadBatch = std::move(batch);
+}
+
+KEngineVulkan::VulkanCore::UploadToken KEngineVulkan::VulkanCore::flushUploadBatch()
+{
+    assert(currentUploadBatch.has_value());
+    UploadBatch& batch = currentUploadBatch.value();
+
+    if (!hasDedicatedTransferQueue()) {
+        //Make every transfer in the batch visible to whatever the following frames read it with
+        VkMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(batch.commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+    }
+
+    if (vkEndCommandBuffer(batch.commandBuffer) != VK_SUCCESS) {
+        throw std::runtime_error("failed to record upload batch!");
+    }
+
+    vmaFlushAllocation(allocator, stagingRing.second, 0, VK_WHOLE_SIZE); // No-op on coherent memory
+
+    VkSubmitInfo submitInfo{};
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &batch.commandBuffer;
+
+    VkSemaphore handoffSemaphore = VK_NULL_HANDLE;
+    if (hasDedicatedTransferQueue() && (!batch.bufferAcquires.empty() || !batch.imageAcquires.empty() || !batch.mipmaps.empty())) {
+        if (!freeUploadSemaphores.empty()) {
+            handoffSemaphore = freeUploadSemaphores.back();
+            freeUploadSemaphores.pop_back();
+        }
+        else {
+            VkSemaphoreCreateInfo semaphoreInfo{};
+            semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+            if (vkCreateSemaphore(device, &semaphoreInfo, nullptr, &handoffSemaphore) != VK_SUCCESS) {
+                throw std::runtime_error("failed to create upload semaphore!");
+            }
+        }
+        submitInfo.signalSemaphoreCount = 1;
+        submitInfo.pSignalSemaphores = &handoffSemaphore;
+    }
+
+    if (vkQueueSubmit(transferQueue, 1, &submitInfo, batch.fence) != VK_SUCCESS) {
+        throw std::runtime_error("failed to submit upload batch!");
+    }
+
+    if (handoffSemaphore != VK_NULL_HANDLE) {
+        pendingUploadSemaphores.push_back(handoffSemaphore);
+        pendingBufferAcquires.insert(pendingBufferAcquires.end(), batch.bufferAcquires.begin(), batch.bufferAcquires.end());
+        pendingImageAcquires.insert(pendingImageAcquires.end(), batch.imageAcquires.begin(), batch.imageAcquires.end());
+        pendingMipmaps.insert(pendingMipmaps.end(), batch.mipmaps.begin(), batch.mipmaps.end());
+        batch.bufferAcquires.clear();
+        batch.imageAcquires.clear();
+        batch.mipmaps.clear();
+    }
+
+    UploadToken token = batch.token;
+    submittedUploadBatches.push_back(std::move(batch));
+    currentUploadBatch.reset();
+    return token;
+}
+
+bool KEngineVulkan::VulkanCore::inUploadBatch() const
+{
+    return currentUploadBatch.has_value();
+}
+
+bool KEngineVulkan::VulkanCore::isUploadComplete(UploadToken token)
+{
+    collectUploadBatches();
+    return token <= completedUploadToken;
+}
+
+void KEngineVulkan::VulkanCore::waitForUpload(UploadToken token)
+{
+    while (token > completedUploadToken && !submittedUploadBatches.empty()) {
+        vkWaitForFences(device, 1, &submittedUploadBatches.front().fence, VK_TRUE, UINT64_MAX);
+        collectUploadBatches();
+    }
+}
+
+void KEngineVulkan::VulkanCore::destroyAfterUpload(VkBuffer buffer, VmaAllocation bufferAllocation)
+{
+    assert(currentUploadBatch.has_value());
+    currentUploadBatch->stagingBuffers.push_back({ buffer, bufferAllocation });
+}
+
+KEngineVulkan::VulkanCore::StagingAllocation KEngineVulkan::VulkanCore::allocateStaging(VkDeviceSize size, VkDeviceSize alignment)
+{
+    assert(currentUploadBatch.has_value());
+    stagingStats.allocations++;
+
+    if (size > STAGING_RING_SIZE) {
+        StagingAllocation staging;
+        VmaAllocation stagingAllocation;
+        createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, (VmaAllocationCreateFlagBits)(VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT | VMA_ALLOCATION_CREATE_MAPPED_BIT), staging.buffer, stagingAllocation);
+        VmaAllocationInfo allocationInfo;
+        vmaGetAllocationInfo(allocator, stagingAllocation, &allocationInfo);
+        staging.offset = 0;
+        staging.data = allocationInfo.pMappedData;
+        destroyAfterUpload(staging.buffer, stagingAllocation);
+        stagingStats.oversizedAllocations++;
+        return staging;
+    }
+
+    VkDeviceSize offset;
+    while (!tryAllocateStaging(size, alignment, offset)) {
+        stagingStats.stalls++;
+        if (stagingRegions.front().token == currentUploadBatch->token) {
+            //The open batch filled the ring by itself, submit what it has so far and carry on in a fresh one.
+            //Tokens complete in order, so the token the caller eventually gets still covers everything.
+            bool implicit = implicitUploadBatch;
+            flushUploadBatch();
+            beginUploadBatch();
+            implicitUploadBatch = implicit;
+        }
+        waitForUpload(stagingRegions.front().token);
+    }
+
+    return { stagingRing.first, offset, stagingRingData + offset };
+}
+
+bool KEngineVulkan::VulkanCore::tryAllocateStaging(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset)
+{
+    if (stagingRegions.empty()) {
+        stagingHead = 0;
+        stagingTail = 0;
+    }
+
+    VkDeviceSize start = stagingHead;
+    VkDeviceSize alignedHead = (stagingHead + alignment - 1) / alignment * alignment;
+    if (stagingRegions.empty() || stagingHead > stagingTail) {
+        if (alignedHead + size <= STAGING_RING_SIZE) {
+            offset = alignedHead;
+        }
+        else if (size <= stagingTail) {
+            offset = 0; // Wrap, the skipped end of the ring is released along with this batch
+        }
+        else {
+            return false;
+        }
+    }
+    else if (alignedHead + size <= stagingTail) {
+        offset = alignedHead;
+    }
+    else {
+        return false;
+    }
+
+    VkDeviceSize end = offset + size;
+    VkDeviceSize consumed = offset >= start ? end - start : (STAGING_RING_SIZE - start) + end;
+    stagingHead = end;
+
+    UploadToken token = currentUploadBatch->token;
+    if (stagingRegions.empty() || stagingRegions.back().token != token) {
+        stagingRegions.push_back({ token, end, consumed });
+    }
+    else {
+        stagingRegions.back().end = end;
+        stagingRegions.back().size += consumed;
+    }
+
+    stagingStats.bytesInUse += consumed;
+    stagingStats.highWaterMark = std::max(stagingStats.highWaterMark, stagingStats.bytesInUse);
+    return true;
+}
 
-    vmaDestroyBuffer(allocator, stagingBuffer, stagingBufferAllocation);
+const KEngineVulkan::VulkanCore::StagingStats& KEngineVulkan::VulkanCore::getStagingStats() const
+{
+    return stagingStats;
+}
+
+void KEngineVulkan::VulkanCore::setFullViewport(VkCommandBuffer commandBuffer) const
+{
+    VkViewport viewport{};
+    viewport.x = 0.0f;
+    viewport.y = 0.0f;
+    viewport.width = (float)swapChainExtent.width;
+    viewport.height = (float)swapChainExtent.height;
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+    vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+    VkRect2D scissor{};
+    scissor.offset = { 0, 0 };
+    scissor.extent = swapChainExtent;
+    vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+}
+
+bool KEngineVulkan::VulkanCore::hasDedicatedTransferQueue() const
+{
+    return transferQueueFamily != graphicsQueueFamily;
+}
+
+KEngineVulkan::VulkanCore::FrameUniformAllocation KEngineVulkan::VulkanCore::allocateFrameUniforms(VkDeviceSize size)
+{
+    assert(mInRenderPass);
+    //The head stays aligned, so a single fetch_add is enough for concurrent recording threads
+    VkDeviceSize alignedSize = alignFrameUniformSize(size);
+    VkDeviceSize offset = frameUniformHead.fetch_add(alignedSize);
+    if (offset + alignedSize > frameUniformSizes[currentFrame]) {
+        throw std::runtime_error("frame uniform arena exhausted, reserveFrameUniforms before recording!");
+    }
+    return { frameUniformArenas[currentFrame].first, static_cast<uint32_t>(offset), frameUniformData[currentFrame] + offset };
+}
+
+VkBuffer KEngineVulkan::VulkanCore::getFrameUniformBuffer(int frame) const
+{
+    return frameUniformArenas[frame].first;
+}
+
+VkDeviceSize KEngineVulkan::VulkanCore::alignFrameUniformSize(VkDeviceSize size) const
+{
+    return (size + uniformOffsetAlignment - 1) / uniformOffsetAlignment * uniformOffsetAlignment;
+}
+
+void KEngineVulkan::VulkanCore::reserveFrameUniforms(VkDeviceSize size)
+{
+    assert(mInRenderPass);
+    VkDeviceSize head = frameUniformHead.load();
+    if (head + size <= frameUniformSizes[currentFrame]) {
+        return;
+    }
+
+    //What was allocated so far stays in the old arena, already bound where it was used, and new allocations start over
+    if (head > 0) {
+        vmaFlushAllocation(allocator, frameUniformArenas[currentFrame].second, 0, head);
+    }
+    VkDeviceSize newSize = frameUniformSizes[currentFrame] * 2;
+    while (newSize < size) {
+        newSize *= 2;
+    }
+    createFrameUniformArena(currentFrame, newSize);
+    frameUniformRetiredBytes += head;
+    frameUniformHead = 0;
+    frameUniformStats.arenaSize = std::max(frameUniformStats.arenaSize, newSize);
+    frameUniformStats.growths++;
+}
+
+uint64_t KEngineVulkan::VulkanCore::getFrameUniformGeneration(int frame) const
+{
+    return frameUniformGenerations[frame];
+}
+
+const KEngineVulkan::VulkanCore::FrameUniformStats& KEngineVulkan::VulkanCore::getFrameUniformStats() const
+{
+    return frameUniformStats;
+}
+
+void KEngineVulkan::VulkanCore::recordUploadAcquires(VkCommandBuffer commandBuffer)
+{
+    if (pendingUploadSemaphores.empty()) {
+        return;
+    }
+
+    //Stages must match the wait stage the frame submit uses for these semaphores, transfer covers the mipmap blits below
+    vkCmdPipelineBarrier(commandBuffer,
+        VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+        VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+        0,
+        0, nullptr,
+        static_cast<uint32_t>(pendingBufferAcquires.size()), pendingBufferAcquires.data(),
+        static_cast<uint32_t>(pendingImageAcquires.size()), pendingImageAcquires.data());
+
+    frameUploadSemaphores[currentFrame].insert(frameUploadSemaphores[currentFrame].end(), pendingUploadSemaphores.begin(), pendingUploadSemaphores.end());
+    pendingUploadSemaphores.clear();
+    pendingBufferAcquires.clear();
+    pendingImageAcquires.clear();
+
+    for (const PendingMipmaps& mipmaps : pendingMipmaps) {
+        recordMipmapBlits(commandBuffer, mipmaps.image, mipmaps.width, mipmaps.height, mipmaps.mipLevels);
+    }
+    pendingMipmaps.clear();
+}
+
+uint32_t KEngineVulkan::VulkanCore::mipLevelCount(uint32_t width, uint32_t height)
+{
+    uint32_t levels = 1;
+    for (uint32_t size = std::max(width, height); size > 1; size >>= 1) {
+        levels++;
+    }
+    return levels;
+}
+
+bool KEngineVulkan::VulkanCore::supportsLinearBlit(VkFormat format) const
+{
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &formatProperties);
+    VkFormatFeatureFlags required = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    return (formatProperties.optimalTilingFeatures & required) == required;
+}
+
+bool KEngineVulkan::VulkanCore::supportsSampledFormat(VkFormat format) const
+{
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(physicalDevice, format, &formatProperties);
+    VkFormatFeatureFlags required = VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    return (formatProperties.optimalTilingFeatures & required) == required;
+}
+
+void KEngineVulkan::VulkanCore::generateMipmaps(VkImage image, VkFormat format, uint32_t width, uint32_t height, uint32_t mipLevels)
+{
+    assert(supportsLinearBlit(format));
+    VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+    if (hasDedicatedTransferQueue()) {
+        //Release every level still in TRANSFER_DST, the graphics queue acquires it and runs the cascade next frame
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.srcQueueFamilyIndex = transferQueueFamily;
+        barrier.dstQueueFamilyIndex = graphicsQueueFamily;
+        barrier.image = image;
+        barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, mipLevels, 0, 1 };
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = 0;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+        VkImageMemoryBarrier acquire = barrier;
+        acquire.srcAccessMask = 0;
+        acquire.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+        currentUploadBatch->imageAcquires.push_back(acquire);
+        currentUploadBatch->mipmaps.push_back({ image, width, height, mipLevels });
+    }
+    else {
+        recordMipmapBlits(commandBuffer, image, width, height, mipLevels);
+    }
+    endSingleTimeCommands(commandBuffer);
+}
+
+void KEngineVulkan::VulkanCore::recordMipmapBlits(VkCommandBuffer commandBuffer, VkImage image, uint32_t width, uint32_t height, uint32_t mipLevels)
+{
+    VkImageMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+
+    //Each level is made a blit source once written, then handed to the shaders once the next level is read from it
+    int32_t levelWidth = static_cast<int32_t>(width);
+    int32_t levelHeight = static_cast<int32_t>(height);
+    for (uint32_t level = 1; level < mipLevels; level++) {
+        barrier.subresourceRange.baseMipLevel = level - 1;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+        int32_t nextWidth = std::max(levelWidth / 2, 1);
+        int32_t nextHeight = std::max(levelHeight / 2, 1);
+        VkImageBlit blit{};
+        blit.srcOffsets[0] = { 0, 0, 0 };
+        blit.srcOffsets[1] = { levelWidth, levelHeight, 1 };
+        blit.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level - 1, 0, 1 };
+        blit.dstOffsets[0] = { 0, 0, 0 };
+        blit.dstOffsets[1] = { nextWidth, nextHeight, 1 };
+        blit.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level, 0, 1 };
+        vkCmdBlitImage(commandBuffer, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blit, VK_FILTER_LINEAR);
+
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+        levelWidth = nextWidth;
+        levelHeight = nextHeight;
+    }
+
+    barrier.subresourceRange.baseMipLevel = mipLevels - 1;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+void KEngineVulkan::VulkanCore::collectUploadBatches()
+{
+    while (!submittedUploadBatches.empty() && vkGetFenceStatus(device, submittedUploadBatches.front().fence) == VK_SUCCESS) {
+        UploadBatch batch = std::move(submittedUploadBatches.front());
+        submittedUploadBatches.pop_front();
+
+        for (auto& bufferPair : batch.stagingBuffers) {
+            vmaDestroyBuffer(allocator, bufferPair.first, bufferPair.second);
+        }
+        batch.stagingBuffers.clear();
+        completedUploadToken = batch.token;
+
+        while (!stagingRegions.empty() && stagingRegions.front().token <= completedUploadToken) {
+            stagingTail = stagingRegions.front().end;
+            stagingStats.bytesInUse -= stagingRegions.front().size;
+            stagingRegions.pop_front();
+        }
+
+        vkResetFences(device, 1, &batch.fence);
+        vkResetCommandBuffer(batch.commandBuffer, 0);
+        freeUploadBatches.push_back(std::move(batch));
+    }
 }
 
 void KEngineVulkan::VulkanCore::startFrame()
 {
     assert(!mInRenderPass);
     mInRenderPass = true;
+    collectUploadBatches();
     vkWaitForFences(device, 1, &inFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
 
-    VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
-    if (result == VK_ERROR_OUT_OF_DATE_KHR) {
-        //recreateSwapChain();
-        throw std::runtime_error("re-create swap chain not yet implemented.");
-        return;
+    //The frame that waited on these has finished, so they can be signalled again
+    freeUploadSemaphores.insert(freeUploadSemaphores.end(), frameUploadSemaphores[currentFrame].begin(), frameUploadSemaphores[currentFrame].end());
+    frameUploadSemaphores[currentFrame].clear();
+    frameUniformHead = 0;
+    frameUniformRetiredBytes = 0;
+    for (auto& arena : retiredFrameUniformArenas[currentFrame]) {
+        vmaDestroyBuffer(allocator, arena.first, arena.second);
+    }
+    retiredFrameUniformArenas[currentFrame].clear();
+    //Another frame needed more, so this one will too
+    if (frameUniformSizes[currentFrame] < frameUniformStats.arenaSize) {
+        createFrameUniformArena(currentFrame, frameUniformStats.arenaSize);
+    }
+
+    if (headless) {
+        deliverReadback(currentFrame);
+        imageIndex = currentFrame;
     }
-    else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
-        throw std::runtime_error("failed to acquire swap chain image!");
+    else {
+        VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX, imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+        if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+            //recreateSwapChain();
+            throw std::runtime_error("re-create swap chain not yet implemented.");
+            return;
+        }
+        else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+            throw std::runtime_error("failed to acquire swap chain image!");
+        }
     }
 
     vkResetFences(device, 1, &inFlightFences[currentFrame]);
 
+    if (!recordingPools.empty()) {
+        for (RecordingPool& recordingPool : recordingPools[currentFrame]) {
+            vkResetCommandPool(device, recordingPool.pool, 0);
+            recordingPool.used = 0;
+        }
+    }
+
     vkResetCommandBuffer(commandBuffers[currentFrame], 0);
     VkCommandBufferBeginInfo beginInfo{};
     beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -740,6 +1494,8 @@ void KEngineVulkan::VulkanCore::startFrame()
         throw std::runtime_error("failed to begin recording command buffer!");
     }
 
+    recordUploadAcquires(commandBuffers[currentFrame]);
+
     VkRenderPassBeginInfo renderPassInfo{};
     renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     renderPassInfo.renderPass = renderPass;
@@ -751,7 +1507,16 @@ void KEngineVulkan::VulkanCore::startFrame()
     renderPassInfo.clearValueCount = 1;
     renderPassInfo.pClearValues = &clearColor;
 
-    vkCmdBeginRenderPass(commandBuffers[currentFrame], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+    if (recordingPools.empty()) {
+        vkCmdBeginRenderPass(commandBuffers[currentFrame], &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+        setFullViewport(commandBuffers[currentFrame]);
+    }
+    else {
+        //A subpass is either all inline or all secondaries, so even single threaded drawing goes into a secondary
+        vkCmdBeginRenderPass(commandBuffers[currentFrame], &renderPassInfo, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        inlineSecondary = beginSecondaryCommandBuffer(0);
+        frameSecondaries.push_back(inlineSecondary);
+    }
 }
 
 
@@ -760,32 +1525,107 @@ void KEngineVulkan::VulkanCore::endFrame()
     assert(mInRenderPass);
     mInRenderPass = false;
 
+    if (!frameSecondaries.empty()) {
+        if (vkEndCommandBuffer(inlineSecondary) != VK_SUCCESS) {
+            throw std::runtime_error("failed to record secondary command buffer!");
+        }
+        inlineSecondary = VK_NULL_HANDLE;
+        vkCmdExecuteCommands(commandBuffers[currentFrame], static_cast<uint32_t>(frameSecondaries.size()), frameSecondaries.data());
+        frameSecondaries.clear();
+    }
+
     vkCmdEndRenderPass(commandBuffers[currentFrame]);
 
+    if (headless) {
+        VkBufferImageCopy region{};
+        region.bufferOffset = 0;
+        region.bufferRowLength = 0;
+        region.bufferImageHeight = 0;
+        region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        region.imageSubresource.mipLevel = 0;
+        region.imageSubresource.baseArrayLayer = 0;
+        region.imageSubresource.layerCount = 1;
+        region.imageOffset = { 0, 0, 0 };
+        region.imageExtent = { swapChainExtent.width, swapChainExtent.height, 1 };
+        vkCmdCopyImageToBuffer(commandBuffers[currentFrame], swapChainImages[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readbackBuffers[currentFrame].first, 1, &region);
+
+        VkBufferMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.buffer = readbackBuffers[currentFrame].first;
+        barrier.offset = 0;
+        barrier.size = VK_WHOLE_SIZE;
+        vkCmdPipelineBarrier(commandBuffers[currentFrame], VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+    }
+
+    VkDeviceSize frameUniformBytes = std::min(frameUniformHead.load(), frameUniformSizes[currentFrame]);
+    if (frameUniformBytes > 0) {
+        vmaFlushAllocation(allocator, frameUniformArenas[currentFrame].second, 0, frameUniformBytes);
+    }
+    frameUniformStats.highWater = std::max(frameUniformStats.highWater, frameUniformRetiredBytes + frameUniformBytes);
+
     if (vkEndCommandBuffer(commandBuffers[currentFrame]) != VK_SUCCESS) {
         throw std::runtime_error("failed to record command buffer!");
     }
 
+    //Handoffs flushed during the frame can't be acquired inside its render pass, a buffer submitted first takes them so
+    //draws recorded after the flush see the data. Its semaphores join the frame's waits below.
+    std::vector<VkCommandBuffer> submitBuffers;
+    if (!pendingUploadSemaphores.empty()) {
+        VkCommandBuffer acquireBuffer = acquireCommandBuffers[currentFrame];
+        vkResetCommandBuffer(acquireBuffer, 0);
+        VkCommandBufferBeginInfo acquireBeginInfo{};
+        acquireBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        acquireBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        if (vkBeginCommandBuffer(acquireBuffer, &acquireBeginInfo) != VK_SUCCESS) {
+            throw std::runtime_error("failed to begin recording command buffer!");
+        }
+        recordUploadAcquires(acquireBuffer);
+        if (vkEndCommandBuffer(acquireBuffer) != VK_SUCCESS) {
+            throw std::runtime_error("failed to record command buffer!");
+        }
+        submitBuffers.push_back(acquireBuffer);
+    }
+    submitBuffers.push_back(commandBuffers[currentFrame]);
+
     VkSubmitInfo submitInfo{};
     submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 
-    VkSemaphore waitSemaphores[] = { imageAvailableSemaphores[currentFrame] };
-    VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
-    submitInfo.waitSemaphoreCount = 1;
-    submitInfo.pWaitSemaphores = waitSemaphores;
-    submitInfo.pWaitDstStageMask = waitStages;
+    std::vector<VkSemaphore> waitSemaphores;
+    std::vector<VkPipelineStageFlags> waitStages;
+    if (!headless) {
+        waitSemaphores.push_back(imageAvailableSemaphores[currentFrame]);
+        waitStages.push_back(VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT);
+    }
+    for (VkSemaphore uploadSemaphore : frameUploadSemaphores[currentFrame]) {
+        waitSemaphores.push_back(uploadSemaphore);
+        waitStages.push_back(VK_PIPELINE_STAGE_VERTEX_INPUT_BIT);
+    }
+    submitInfo.waitSemaphoreCount = static_cast<uint32_t>(waitSemaphores.size());
+    submitInfo.pWaitSemaphores = waitSemaphores.data();
+    submitInfo.pWaitDstStageMask = waitStages.data();
 
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
+    submitInfo.commandBufferCount = static_cast<uint32_t>(submitBuffers.size());
+    submitInfo.pCommandBuffers = submitBuffers.data();
 
     VkSemaphore signalSemaphores[] = { renderFinishedSemaphores[currentFrame] };
-    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.signalSemaphoreCount = headless ? 0 : 1;
     submitInfo.pSignalSemaphores = signalSemaphores;
 
     if (vkQueueSubmit(graphicsQueue, 1, &submitInfo, inFlightFences[currentFrame]) != VK_SUCCESS) {
         throw std::runtime_error("failed to submit draw command buffer!");
     }
 
+    if (headless) {
+        //Picked up when this slot comes around again in startFrame, or by flushReadbacks
+        pendingReadbacks[currentFrame] = frameNumber++;
+        currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+        return;
+    }
+
     VkPresentInfoKHR presentInfo{};
     presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
 
@@ -891,7 +1731,8 @@ bool KEngineVulkan::VulkanCore::checkDeviceExtensionSupport(VkPhysicalDevice dev
     std::vector<VkExtensionProperties> availableExtensions(extensionCount);
     vkEnumerateDeviceExtensionProperties(device, nullptr, &extensionCount, availableExtensions.data());
 
-    std::set<std::string> requiredExtensions(deviceExtensions.begin(), deviceExtensions.end());
+    auto extensions = getRequiredDeviceExtensions();
+    std::set<std::string> requiredExtensions(extensions.begin(), extensions.end());
 
     for (const auto& extension : availableExtensions) {
         requiredExtensions.erase(extension.extensionName);
@@ -906,8 +1747,8 @@ bool KEngineVulkan::VulkanCore::isDeviceSuitable(VkPhysicalDevice device) const
 {
     QueueFamilyIndices indices = findQueueFamilies(device);
     bool extensionsSupported = checkDeviceExtensionSupport(device);
-    bool swapChainAdequate = false;
-    if (extensionsSupported) {
+    bool swapChainAdequate = headless;
+    if (extensionsSupported && !headless) {
         SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
         swapChainAdequate = !swapChainSupport.formats.empty() && !swapChainSupport.presentModes.empty();
     }
@@ -917,7 +1758,7 @@ bool KEngineVulkan::VulkanCore::isDeviceSuitable(VkPhysicalDevice device) const
     return indices.isComplete() && extensionsSupported && swapChainAdequate && supportedFeatures.samplerAnisotropy;
 }
 
-VkImageView KEngineVulkan::VulkanCore::createImageView(VkImage image, VkFormat format) const
+VkImageView KEngineVulkan::VulkanCore::createImageView(VkImage image, VkFormat format, uint32_t mipLevels) const
 {
     VkImageViewCreateInfo viewInfo{};
     viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
@@ -926,7 +1767,7 @@ VkImageView KEngineVulkan::VulkanCore::createImageView(VkImage image, VkFormat f
     viewInfo.format = format;
     viewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     viewInfo.subresourceRange.baseMipLevel = 0;
-    viewInfo.subresourceRange.levelCount = 1;
+    viewInfo.subresourceRange.levelCount = mipLevels;
     viewInfo.subresourceRange.baseArrayLayer = 0;
     viewInfo.subresourceRange.layerCount = 1;
 
@@ -951,48 +1792,178 @@ inline uint32_t KEngineVulkan::VulkanCore::findMemoryType(uint32_t typeFilter, V
 }
 
 inline VkCommandBuffer KEngineVulkan::VulkanCore::beginSingleTimeCommands() {
-    VkCommandBufferAllocateInfo allocInfo{};
-    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    allocInfo.commandPool = commandPool;
-    allocInfo.commandBufferCount = 1;
-
-    VkCommandBuffer commandBuffer;
-    vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
-
-    VkCommandBufferBeginInfo beginInfo{};
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
-
-    vkBeginCommandBuffer(commandBuffer, &beginInfo);
-
-    return commandBuffer;
+    if (!currentUploadBatch.has_value()) {
+        beginUploadBatch();
+        implicitUploadBatch = true;
+    }
+    return currentUploadBatch->commandBuffer;
 }
 
 inline void KEngineVulkan::VulkanCore::endSingleTimeCommands(VkCommandBuffer commandBuffer) {
-    vkEndCommandBuffer(commandBuffer);
-
-    VkSubmitInfo submitInfo{};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffer;
-
-    vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-    vkQueueWaitIdle(graphicsQueue); //Improve this to allow multiple buffer copies in flight simultaneously
-
-    vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+    assert(currentUploadBatch.has_value() && currentUploadBatch->commandBuffer == commandBuffer);
+    if (implicitUploadBatch) {
+        //Callers outside a batch may free their source buffers as soon as we return
+        implicitUploadBatch = false;
+        waitForUpload(flushUploadBatch());
+    }
 }
 
 std::vector<const char*> KEngineVulkan::VulkanCore::getRequiredExtensions() const
 {
 
     std::vector<const char*> extensions;
-    extensions.push_back("VK_KHR_surface");
+    if (!headless) {
+        extensions.push_back("VK_KHR_surface");
 #if defined(_WIN32) || defined(_WINDOWS)
-    extensions.push_back("VK_KHR_win32_surface");
+        extensions.push_back("VK_KHR_win32_surface");
 #endif
+    }
     if (enableValidationLayers) {
         extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
     }
     return extensions;
 }
+
+std::vector<const char*> KEngineVulkan::VulkanCore::getRequiredDeviceExtensions() const
+{
+    if (headless) {
+        return {};
+    }
+    return deviceExtensions;
+}
+
+KEngineVulkan::VulkanCore::~VulkanCore()
+{
+    workerPool.Stop();
+}
+
+KEngineVulkan::WorkerPool& KEngineVulkan::VulkanCore::getWorkerPool()
+{
+    return workerPool;
+}
+
+void KEngineVulkan::VulkanCore::setWorkerThreadCount(uint32_t threadCount)
+{
+    assert(!mInRenderPass);
+    workerPool.Start(threadCount);
+}
+
+void KEngineVulkan::VulkanCore::setRecordingThreadCount(uint32_t threadCount)
+{
+    assert(!mInRenderPass);
+    threadCount = std::max(threadCount, 1u);
+    if (threadCount == recordingThreadCount) {
+        return;
+    }
+
+    if (!recordingPools.empty()) {
+        vkDeviceWaitIdle(device); // Frames in flight may still be executing secondaries from these pools
+        for (auto& framePools : recordingPools) {
+            for (RecordingPool& recordingPool : framePools) {
+                vkDestroyCommandPool(device, recordingPool.pool, nullptr);
+            }
+        }
+        recordingPools.clear();
+    }
+
+    recordingThreadCount = threadCount;
+    if (threadCount > 1) {
+        //Transient pools reset whole each frame, buffers are never reset one at a time
+        VkCommandPoolCreateInfo poolInfo{};
+        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+        poolInfo.queueFamilyIndex = graphicsQueueFamily;
+
+        recordingPools.resize(MAX_FRAMES_IN_FLIGHT);
+        for (auto& framePools : recordingPools) {
+            framePools.resize(threadCount);
+            for (RecordingPool& recordingPool : framePools) {
+                if (vkCreateCommandPool(device, &poolInfo, nullptr, &recordingPool.pool) != VK_SUCCESS) {
+                    throw std::runtime_error("failed to create recording command pool!");
+                }
+            }
+        }
+    }
+}
+
+uint32_t KEngineVulkan::VulkanCore::getRecordingThreadCount() const
+{
+    return recordingThreadCount;
+}
+
+void KEngineVulkan::VulkanCore::recordSecondaryCommandBuffers(uint32_t count, const SecondaryRecorder& recorder)
+{
+    assert(mInRenderPass);
+    if (recordingPools.empty()) {
+        for (uint32_t i = 0; i < count; i++) {
+            recorder(i, commandBuffers[currentFrame]);
+        }
+        return;
+    }
+    assert(count <= recordingThreadCount);
+    if (count == 0) {
+        return;
+    }
+
+    //Close what the frame has recorded so far so the new buffers execute after it
+    if (vkEndCommandBuffer(inlineSecondary) != VK_SUCCESS) {
+        throw std::runtime_error("failed to record secondary command buffer!");
+    }
+    recordingBuffers.resize(count);
+    for (uint32_t i = 0; i < count; i++) {
+        recordingBuffers[i] = beginSecondaryCommandBuffer(i);
+    }
+
+    //Urgent so the frame isn't stuck behind queued decodes and compiles
+    std::exception_ptr error = workerPool.ParallelFor(count, [&](size_t i) {
+        recorder(static_cast<uint32_t>(i), recordingBuffers[i]);
+    }, true);
+
+    for (VkCommandBuffer buffer : recordingBuffers) {
+        if (vkEndCommandBuffer(buffer) != VK_SUCCESS) {
+            throw std::runtime_error("failed to record secondary command buffer!");
+        }
+    }
+    frameSecondaries.insert(frameSecondaries.end(), recordingBuffers.begin(), recordingBuffers.end());
+    inlineSecondary = beginSecondaryCommandBuffer(0);
+    frameSecondaries.push_back(inlineSecondary);
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+VkCommandBuffer KEngineVulkan::VulkanCore::beginSecondaryCommandBuffer(uint32_t thread)
+{
+    RecordingPool& recordingPool = recordingPools[currentFrame][thread];
+    if (recordingPool.used == recordingPool.buffers.size()) {
+        VkCommandBufferAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        allocInfo.commandPool = recordingPool.pool;
+        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        allocInfo.commandBufferCount = 1;
+        VkCommandBuffer buffer;
+        if (vkAllocateCommandBuffers(device, &allocInfo, &buffer) != VK_SUCCESS) {
+            throw std::runtime_error("failed to allocate secondary command buffer!");
+        }
+        recordingPool.buffers.push_back(buffer);
+    }
+    VkCommandBuffer buffer = recordingPool.buffers[recordingPool.used++];
+
+    VkCommandBufferInheritanceInfo inheritanceInfo{};
+    inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritanceInfo.renderPass = renderPass;
+    inheritanceInfo.subpass = 0;
+    inheritanceInfo.framebuffer = swapChainFramebuffers[imageIndex];
+
+    VkCommandBufferBeginInfo beginInfo{};
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT | VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    beginInfo.pInheritanceInfo = &inheritanceInfo;
+
+    if (vkBeginCommandBuffer(buffer, &beginInfo) != VK_SUCCESS) {
+        throw std::runtime_error("failed to begin recording secondary command buffer!");
+    }
+    setFullViewport(buffer); // Secondaries don't inherit dynamic state
+    return buffer;
+}
@@ -7,34 +7,112 @@
 #endif
 #include "vk_mem_alloc.h"
 #include <vulkan/vulkan.h>
+#include "WorkerPool.h"
 #include <string>
 #include <vector>
 #include <algorithm>
 #include <limits>
 #include <optional>
+#include <functional>
+#include <deque>
+#include <atomic>
 
 namespace KEngineVulkan {
 	class VulkanCore
 	{
 	public:
+		~VulkanCore();
 #if defined(_WIN32) || defined(_WINDOWS)
 		void Init(const std::string& applicationName, HWND hwnd, HINSTANCE hinstance);
-#else
-		//void initialize(const std::string& applicationName);  //To be determined/implemented
 #endif
+		//Renders into offscreen images instead of a swap chain, no window or surface required
+		void InitHeadless(const std::string& applicationName, int width, int height);
+
+		//Called with the pixels of each headless frame once the GPU has finished with it, frames arrive in submission order
+		typedef std::function<void(uint64_t frameNumber, const void* pixels, uint32_t width, uint32_t height, uint32_t rowPitch)> ReadbackCallback;
+		void setReadbackCallback(ReadbackCallback callback);
+		void flushReadbacks();
+		bool isHeadless() const;
+
 		VkDevice getDevice() const;
+		VkPhysicalDevice getPhysicalDevice() const;
+		bool hasPipelineCreationFeedback() const; // VK_EXT_pipeline_creation_feedback is enabled, pipelines can report cache hits
 		VmaAllocator getAllocator() const;
 		VkRenderPass getRenderPass() const;
 		const VkExtent2D & getFramebufferExtent() const;
 		VkSampler getSampler(bool repeat = false) const;
 
 		void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VmaAllocationCreateFlagBits memoryProperties, VkBuffer& buffer, VmaAllocation & bufferAllocation);
-		void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkImage& image, VmaAllocation & imageAllocation);
+		void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkImage& image, VmaAllocation & imageAllocation, uint32_t mipLevels = 1);
 	
-		//Loading commands, should create a "loading frame complete" function or something to allow their commands to be combined
-		void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout);
-		void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height);
-		void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size);
+		//Upload batches record every loading command into one command buffer with a single submit.
+		//Outside of a batch each loading command is submitted on its own and waited on.
+		//On devices with a dedicated transfer queue batches run there, and their results are handed over to the graphics queue
+		//at the start of the next frame. Uploads flushed while a frame is open are handed over by a command buffer submitted
+		//just ahead of that frame's own, so the frame can already draw with them.
+		typedef uint64_t UploadToken;
+		void beginUploadBatch();
+		UploadToken flushUploadBatch();
+		bool inUploadBatch() const;
+		bool isUploadComplete(UploadToken token);
+		void waitForUpload(UploadToken token);
+		void destroyAfterUpload(VkBuffer buffer, VmaAllocation bufferAllocation); // Freed once the batch using it completes
+
+		//Staging memory for uploads, suballocated from a persistently mapped ring and reclaimed when its batch completes.
+		//Must be called inside an upload batch.
+		struct StagingAllocation {
+			VkBuffer buffer;
+			VkDeviceSize offset;
+			void* data;
+		};
+		struct StagingStats {
+			VkDeviceSize capacity{ 0 };
+			VkDeviceSize bytesInUse{ 0 };
+			VkDeviceSize highWaterMark{ 0 };
+			uint64_t allocations{ 0 };
+			uint64_t stalls{ 0 };                // Waits on the GPU because the ring was full
+			uint64_t oversizedAllocations{ 0 };  // Too big for the ring, given a dedicated buffer instead
+		};
+		StagingAllocation allocateStaging(VkDeviceSize size, VkDeviceSize alignment = 16);
+		const StagingStats& getStagingStats() const;
+		bool hasDedicatedTransferQueue() const;
+
+		//Per-frame uniform data, bump allocated from a persistently mapped arena that is reset when the frame comes around again.
+		//Bound as a dynamic uniform buffer, the returned offset is the dynamic offset.
+		struct FrameUniformAllocation {
+			VkBuffer buffer;
+			uint32_t offset;
+			void* data;
+		};
+		FrameUniformAllocation allocateFrameUniforms(VkDeviceSize size);
+		VkBuffer getFrameUniformBuffer(int frame) const;
+		VkDeviceSize alignFrameUniformSize(VkDeviceSize size) const;
+
+		//Growing: reserveFrameUniforms makes sure size more bytes fit in this frame's arena, swapping in one at least twice as large
+		//when they don't. Earlier allocations stay in the old arena until the frame comes around again. Sets pointing at a frame's
+		//arena have to be rewritten before they are next bound whenever getFrameUniformGeneration changes. Call it before recording,
+		//not while recording threads allocate.
+		void reserveFrameUniforms(VkDeviceSize size);
+		uint64_t getFrameUniformGeneration(int frame) const;
+		struct FrameUniformStats {
+			VkDeviceSize arenaSize;     // Largest arena of any frame, the others catch up when their frame starts
+			VkDeviceSize highWater;     // Most bytes a single frame has used
+			uint32_t growths;
+		};
+		const FrameUniformStats& getFrameUniformStats() const;
+
+		//Loading commands
+		void transitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t baseMipLevel = 0, uint32_t levelCount = 1);
+		void copyBufferToImage(VkBuffer buffer, VkImage image, uint32_t width, uint32_t height, VkDeviceSize bufferOffset = 0, uint32_t mipLevel = 0);
+
+		//Fills levels 1 and up from level 0 with a linear blit cascade. Every level must be in TRANSFER_DST_OPTIMAL with level 0 written,
+		//and all of them end in SHADER_READ_ONLY_OPTIMAL. Blits need a graphics queue, so with a dedicated transfer queue the image is
+		//handed over as is and the cascade is recorded at the start of the next frame, along with the other acquires.
+		void generateMipmaps(VkImage image, VkFormat format, uint32_t width, uint32_t height, uint32_t mipLevels);
+		bool supportsLinearBlit(VkFormat format) const; // Without it generateMipmaps can't be used, upload every level instead
+		bool supportsSampledFormat(VkFormat format) const; // Optimal tiling images of this format can be sampled with linear filtering
+		static uint32_t mipLevelCount(uint32_t width, uint32_t height);
+		void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size, VkDeviceSize srcOffset = 0);
 
 
 		template <class DataType>
@@ -42,16 +120,35 @@ namespace KEngineVulkan {
 
 		void uploadIndexBuffer(const uint16_t* data, size_t size, VkBuffer& buffer, VmaAllocation& bufferAllocation);
 
-		VkImageView createImageView(VkImage image, VkFormat format) const;
+		VkImageView createImageView(VkImage image, VkFormat format, uint32_t mipLevels = 1) const;
 
 		void startFrame();
 		void endFrame();
 
+		//The engine's background threads. Recording, texture decodes and shader compiles all share it so they don't each start
+		//a thread per core. Init starts it, setWorkerThreadCount restarts it with another size, 0 picking one from the hardware.
+		WorkerPool& getWorkerPool();
+		void setWorkerThreadCount(uint32_t threadCount); // Outside a frame, finishes what is already queued first
+
+		//Multithreaded recording. With a recording thread count above one the main pass takes secondary command buffers,
+		//each index owns a command pool per frame in flight, and getCommandBuffer returns the frame's current inline secondary.
+		//recordSecondaryCommandBuffers runs the recorder once per index on the worker pool, the calling thread taking indices
+		//too, then executes the results in index order at that point of the frame. With a count of one the recorder runs inline.
+		typedef std::function<void(uint32_t index, VkCommandBuffer commandBuffer)> SecondaryRecorder;
+		void setRecordingThreadCount(uint32_t threadCount); // Outside a frame
+		uint32_t getRecordingThreadCount() const;
+		void recordSecondaryCommandBuffers(uint32_t count, const SecondaryRecorder& recorder);
+
+		//Pipelines leave viewport and scissor dynamic. Every command buffer a frame draws into starts out covering the whole
+		//framebuffer, this puts a buffer back to that after narrowing its scissor.
+		void setFullViewport(VkCommandBuffer commandBuffer) const;
+
 		bool inRenderPass() const;
 		int  getMaxFramesInFlight() const;
 		int  getCurrentFrame() const;
 		VkCommandBuffer getCommandBuffer() const;
 		VkDescriptorPool getDescriptorPool()const ;
+		VkDescriptorSetLayout getViewDescriptorSetLayout() const; // Set 0 of per-view layouts, a single dynamic uniform buffer
 
 	private:
 		void createInstance(const std::string& applicationName);
@@ -63,15 +160,24 @@ namespace KEngineVulkan {
 		void createAllocator();
 		void createSwapChain(int width, int height);
 		void createSwapChainImageViews();
+		void createOffscreenImages(int width, int height);
+		void createReadbackBuffers();
+		void deliverReadback(int frame);
 		void createRenderPass();
 		void createFramebuffers();
 		void createCommandPool();
+		void createStagingRing();
+		void createFrameUniformArenas();
+		void createFrameUniformArena(int frame, VkDeviceSize size); // Retires the frame's current arena, if it has one
 		void createDescriptorPool(int size);
+		void createViewDescriptorSetLayout();
 		void createCommandBuffers();
 		void createSyncObjects();
 		void createTextureSamplers();
+		VkCommandBuffer beginSecondaryCommandBuffer(uint32_t thread);
 		
 		std::vector<const char*> getRequiredExtensions() const; 
+		std::vector<const char*> getRequiredDeviceExtensions() const;
 		bool checkDeviceExtensionSupport(VkPhysicalDevice device) const;
 		
 		static VKAPI_ATTR VkBool32 VKAPI_CALL debugCallback(VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
@@ -88,6 +194,7 @@ namespace KEngineVulkan {
 		struct QueueFamilyIndices {
 			std::optional<uint32_t> graphicsFamily;
 			std::optional<uint32_t> presentFamily;
+			std::optional<uint32_t> transferFamily; // Only set when there is one without graphics support
 
 			bool isComplete() {
 				return graphicsFamily.has_value() && presentFamily.has_value();
@@ -104,12 +211,34 @@ namespace KEngineVulkan {
 
 		uint32_t findMemoryType(uint32_t typeFilter, VkMemoryPropertyFlags properties) const;
 
-		//These two need to be reworked into a begin/end loading frame system, probably threaded
+		//Record into the open upload batch, or an implicit one that is flushed and waited on by endSingleTimeCommands
 		VkCommandBuffer beginSingleTimeCommands();
 		void endSingleTimeCommands(VkCommandBuffer commandBuffer);
 
+		struct PendingMipmaps {
+			VkImage image;
+			uint32_t width;
+			uint32_t height;
+			uint32_t mipLevels;
+		};
+		struct UploadBatch {
+			VkCommandBuffer commandBuffer{ VK_NULL_HANDLE };
+			VkFence fence{ VK_NULL_HANDLE };
+			UploadToken token{ 0 };
+			std::vector<std::pair<VkBuffer, VmaAllocation>> stagingBuffers;
+			std::vector<VkBufferMemoryBarrier> bufferAcquires;
+			std::vector<VkImageMemoryBarrier> imageAcquires;
+			std::vector<PendingMipmaps> mipmaps;
+		};
+		void collectUploadBatches();
+		void recordUploadAcquires(VkCommandBuffer commandBuffer);
+		void recordMipmapBlits(VkCommandBuffer commandBuffer, VkImage image, uint32_t width, uint32_t height, uint32_t mipLevels);
+		bool tryAllocateStaging(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset);
+
 		//Single instance fields
 		const int MAX_FRAMES_IN_FLIGHT = 2;
+		const VkDeviceSize STAGING_RING_SIZE = 32 * 1024 * 1024;
+		const VkDeviceSize FRAME_UNIFORM_ARENA_INITIAL_SIZE = 8 * 1024 * 1024;
 
 		VkInstance instance;
 		VkDebugUtilsMessengerEXT debugMessenger;
@@ -119,17 +248,26 @@ namespace KEngineVulkan {
 		VmaAllocator allocator;
 		VkQueue graphicsQueue;
 		VkQueue presentQueue;
+		VkQueue transferQueue; // Same as graphicsQueue without a dedicated transfer family
+		uint32_t graphicsQueueFamily;
+		uint32_t transferQueueFamily;
 		VkSwapchainKHR swapChain;
 		VkFormat swapChainImageFormat;
 		VkExtent2D swapChainExtent;
 		VkRenderPass renderPass;  // One here, maybe many
 		VkCommandPool commandPool; // Unclear how to manage these
+		VkCommandPool transferCommandPool;
 		VkDescriptorPool descriptorPool; // Unclear how to manage these
+		VkDescriptorSetLayout viewDescriptorSetLayout;
 		std::vector<VkSampler> textureSamplers;
 		int currentFrame{ 0 };
 		uint32_t imageIndex{ 0 };
 		bool mInRenderPass{ false };
 		bool framebufferResized{ false };
+		bool headless{ false };
+		bool memoryBudgetExtension{ false }; // VK_EXT_memory_budget, lets VMA report real heap usage instead of its own estimate
+		bool pipelineCreationFeedbackExtension{ false };
+		uint64_t frameNumber{ 0 };
 
 		//Per swap chain image
 		std::vector<VkImage> swapChainImages;
@@ -138,9 +276,69 @@ namespace KEngineVulkan {
 
 		//Per in-flight render
 		std::vector<VkCommandBuffer> commandBuffers;
+		std::vector<VkCommandBuffer> acquireCommandBuffers; // Upload handoffs flushed during the frame, submitted ahead of it
 		std::vector<VkSemaphore> imageAvailableSemaphores;
 		std::vector<VkSemaphore> renderFinishedSemaphores;
 		std::vector<VkFence> inFlightFences;
+		std::vector<std::vector<VkSemaphore>> frameUploadSemaphores; // Transfer handoffs waited on by this frame's submit
+		std::vector<std::pair<VkBuffer, VmaAllocation>> frameUniformArenas;
+		std::vector<uint8_t*> frameUniformData;
+		std::vector<VkDeviceSize> frameUniformSizes;
+		std::vector<uint64_t> frameUniformGenerations;
+		std::vector<std::vector<std::pair<VkBuffer, VmaAllocation>>> retiredFrameUniformArenas; // Destroyed when their frame's fence next signals
+		std::atomic<VkDeviceSize> frameUniformHead{ 0 }; // Current frame only, recording threads allocate concurrently
+		VkDeviceSize frameUniformRetiredBytes{ 0 };       // Used this frame in arenas already retired
+		FrameUniformStats frameUniformStats{};
+		VkDeviceSize uniformOffsetAlignment{ 0 };
+
+		WorkerPool workerPool;
+
+		//Multithreaded recording, pools are indexed [frame][index], index 0 also taking the frame's inline secondaries
+		struct RecordingPool {
+			VkCommandPool pool{ VK_NULL_HANDLE };
+			std::vector<VkCommandBuffer> buffers;
+			size_t used{ 0 };
+		};
+		uint32_t recordingThreadCount{ 1 };
+		std::vector<std::vector<RecordingPool>> recordingPools;
+		std::vector<VkCommandBuffer> frameSecondaries; // Executed in order at endFrame
+		VkCommandBuffer inlineSecondary{ VK_NULL_HANDLE };
+		std::vector<VkCommandBuffer> recordingBuffers;
+
+		//Headless only, offscreen targets stand in for the swap chain images
+		std::vector<VmaAllocation> offscreenImageAllocations;
+		std::vector<std::pair<VkBuffer, VmaAllocation>> readbackBuffers;
+		std::vector<void*> readbackMappings;
+		std::vector<std::optional<uint64_t>> pendingReadbacks;
+		ReadbackCallback readbackCallback;
+
+		//Upload batches, submitted ones complete in token order since they share a queue
+		std::optional<UploadBatch> currentUploadBatch;
+		bool implicitUploadBatch{ false };
+		std::deque<UploadBatch> submittedUploadBatches;
+		std::vector<UploadBatch> freeUploadBatches;
+		UploadToken nextUploadToken{ 1 };
+		UploadToken completedUploadToken{ 0 };
+
+		//Dedicated transfer queue only, ownership acquires still to be recorded on the graphics queue
+		std::vector<VkBufferMemoryBarrier> pendingBufferAcquires;
+		std::vector<VkImageMemoryBarrier> pendingImageAcquires;
+		std::vector<PendingMipmaps> pendingMipmaps; // Recorded on the graphics queue right after the acquires
+		std::vector<VkSemaphore> pendingUploadSemaphores;
+		std::vector<VkSemaphore> freeUploadSemaphores;
+
+		//Staging ring, live data runs from tail to head and is released a whole batch at a time
+		struct StagingRegion {
+			UploadToken token;
+			VkDeviceSize end;
+			VkDeviceSize size;
+		};
+		std::pair<VkBuffer, VmaAllocation> stagingRing;
+		uint8_t* stagingRingData{ nullptr };
+		VkDeviceSize stagingHead{ 0 };
+		VkDeviceSize stagingTail{ 0 };
+		std::deque<StagingRegion> stagingRegions;
+		StagingStats stagingStats;
 
 #ifdef NDEBUG
 		bool enableValidationLayers{ false };
@@ -162,19 +360,19 @@ namespace KEngineVulkan {
 	{
 		VkDeviceSize bufferSize = sizeof(DataType) * size;
 
-		VkBuffer stagingBuffer;
-		VmaAllocation stagingBufferAllocation;
-		createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_ALLOCATION_CREATE_HOST_ACCESS_SEQUENTIAL_WRITE_BIT, stagingBuffer, stagingBufferAllocation);
+		bool ownBatch = !inUploadBatch();
+		if (ownBatch) {
+			beginUploadBatch();
+		}
 
-		void* data;
-		vmaMapMemory(allocator, stagingBufferAllocation, &data);
-		memcpy(data, vertices, (size_t)bufferSize);
-		vmaUnmapMemory(allocator, stagingBufferAllocation);
+		StagingAllocation staging = allocateStaging(bufferSize);
+		memcpy(staging.data, vertices, (size_t)bufferSize);
 
 		createBuffer(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, (VmaAllocationCreateFlagBits)0, vertexBuffer, vertexBufferAllocation);
 
-		copyBuffer(stagingBuffer, vertexBuffer, bufferSize);
-
-		vmaDestroyBuffer(allocator, stagingBuffer, stagingBufferAllocation);
+		copyBuffer(staging.buffer, vertexBuffer, bufferSize, staging.offset);
+		if (ownBatch) {
+			flushUploadBatch(); // Not waited on, the next frame submit takes the handoff first
+		}
 	}
 }
\ No newline at end of file
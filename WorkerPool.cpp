@@ -0,0 +1,129 @@
+#include "WorkerPool.h"
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+void KEngineVulkan::WorkerPool::Start(uint32_t threadCount)
+{
+    Stop();
+    if (threadCount == 0) {
+        threadCount = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+    }
+    for (uint32_t i = 0; i < threadCount; i++) {
+        mThreads.emplace_back(&WorkerPool::ThreadMain, this);
+    }
+}
+
+void KEngineVulkan::WorkerPool::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mCondition.notify_all();
+    for (std::thread& thread : mThreads) {
+        thread.join();
+    }
+    mThreads.clear();
+    mStopping = false;
+}
+
+uint32_t KEngineVulkan::WorkerPool::GetThreadCount() const
+{
+    return static_cast<uint32_t>(mThreads.size());
+}
+
+void KEngineVulkan::WorkerPool::Queue(std::function<void()> job, bool urgent)
+{
+    //Before Start, or after Stop, there is nobody to hand the job to
+    if (mThreads.empty()) {
+        job();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (urgent) {
+            mJobs.push_front(std::move(job));
+        }
+        else {
+            mJobs.push_back(std::move(job));
+        }
+    }
+    mCondition.notify_one();
+}
+
+std::exception_ptr KEngineVulkan::WorkerPool::ParallelFor(size_t count, const std::function<void(size_t)>& job, bool urgent)
+{
+    //Helpers that only get to run after every index is taken return without touching job, so only this shared state
+    //outlives the call
+    struct Shared
+    {
+        std::atomic<size_t> next{ 0 };
+        std::atomic<bool> failed{ false };
+        std::exception_ptr error;
+        size_t finished{ 0 };
+        std::mutex mutex;
+        std::condition_variable condition;
+    };
+    if (count == 0) {
+        return nullptr;
+    }
+    auto shared = std::make_shared<Shared>();
+    const std::function<void(size_t)>* jobPointer = &job;
+    auto run = [shared, count, jobPointer] {
+        size_t done = 0;
+        for (size_t i = shared->next++; i < count; i = shared->next++) {
+            if (!shared->failed) {
+                try {
+                    (*jobPointer)(i);
+                }
+                catch (...) {
+                    std::lock_guard<std::mutex> lock(shared->mutex);
+                    if (!shared->failed.exchange(true)) {
+                        shared->error = std::current_exception();
+                    }
+                }
+            }
+            done++;
+        }
+        if (done > 0) {
+            std::lock_guard<std::mutex> lock(shared->mutex);
+            shared->finished += done;
+            if (shared->finished == count) {
+                shared->condition.notify_all();
+            }
+        }
+    };
+
+    size_t helpers = std::min<size_t>(mThreads.size(), count - 1);
+    for (size_t i = 0; i < helpers; i++) {
+        Queue(run, urgent);
+    }
+    run();
+
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    shared->condition.wait(lock, [&shared, count] { return shared->finished == count; });
+    return shared->error;
+}
+
+void KEngineVulkan::WorkerPool::ThreadMain()
+{
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mCondition.wait(lock, [this] { return mStopping || !mJobs.empty(); });
+            if (mJobs.empty()) {
+                return;
+            }
+            job = std::move(mJobs.front());
+            mJobs.pop_front();
+        }
+        try {
+            job();
+        }
+        catch (...) {
+            //Nobody is left to hand it to, the job was meant to report it itself
+        }
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <cstdint>
+
+namespace KEngineVulkan {
+
+    //One set of worker threads for everything the engine runs in the background: secondary command buffer recording,
+    //texture decodes and shader compiles. Sharing it keeps those from each starting a thread per core.
+    class WorkerPool
+    {
+    public:
+        ~WorkerPool() { Stop(); }
+        void Start(uint32_t threadCount); // 0 uses one less than the hardware thread count, the caller being the last one
+        void Stop();                      // Runs the queued jobs first
+        uint32_t GetThreadCount() const;
+
+        //Urgent jobs go ahead of everything queued, for work a frame is waiting on. Jobs report their own failures, an exception
+        //escaping one on a worker is dropped so it can't take the process down. Before Start jobs run inline on the caller.
+        void Queue(std::function<void()> job, bool urgent = false);
+
+        //Runs job(0) to job(count - 1) on the workers and the calling thread and returns once all have finished. The caller
+        //takes indices too, so this completes even while every worker is busy with something long. The first exception a job
+        //throws is returned, and indices not yet started are skipped.
+        std::exception_ptr ParallelFor(size_t count, const std::function<void(size_t)>& job, bool urgent = false);
+
+    private:
+        void ThreadMain();
+
+        std::vector<std::thread> mThreads;
+        std::deque<std::function<void()>> mJobs;
+        std::mutex mMutex;
+        std::condition_variable mCondition;
+        bool mStopping{ false };
+    };
+}